@@ -0,0 +1,125 @@
+// +-------------------------------------------------------------------------+
+// |                   Manager game server, vers. 0.4.01                     |
+// |    Copyright (c) Andrey Vikt. Stolyarov <avst_AT_cs.msu.ru> 2004-2006   |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                     GNU GENERAL PUBLIC LICENSE, v.2                     |
+// | as published by Free Software Foundation      (see the file COPYING)    |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scriptpp/scrvar.hpp"
+
+#include "cmdline.hpp"
+
+
+  // the same as ScriptVector uses by default
+static bool is_delim(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+CommandLine::CommandLine(const char *a_line)
+{
+    count = 0;
+    const char *p = a_line;
+    while(count < max_words) {
+        while(*p && is_delim(*p)) p++;
+        if(!*p)
+            break;
+        words[count] = p;
+        while(*p && !is_delim(*p)) p++;
+        lens[count] = p - words[count];
+        count++;
+    }
+}
+
+bool CommandLine::Is(int i, const char *s) const
+{
+    if(i >= count)
+        return false;
+    return 0 == strncmp(words[i], s, lens[i]) && s[lens[i]] == '\0';
+}
+
+bool CommandLine::GetLong(int i, long &l) const
+{
+    char buf[32];
+    if(i >= count || !CopyWord(i, buf, sizeof(buf)))
+        return false;
+    char *err;
+    long ret = strtol(buf, &err, 0);
+    if(*err != '\0')
+        return false;
+    l = ret;
+    return true;
+}
+
+bool CommandLine::CopyWord(int i, char *buf, int size) const
+{
+    int len = WordLength(i);
+    if(len >= size) {
+        buf[0] = '\0';
+        return false;
+    }
+    memcpy(buf, Word(i), len);
+    buf[len] = '\0';
+    return true;
+}
+
+void CommandLine::AppendWords(ScriptVariable &sv, int i) const
+{
+    if(i >= count)
+        return;
+    const char *p = words[i];
+    while(*p) {
+        while(*p && !is_delim(*p)) 
+            sv += *p++;
+        sv += ' ';
+        while(*p && is_delim(*p)) p++;
+    }
+}
+
+
+CommandTable::CommandTable(const CommandVerb *a_verbs, int count)
+{
+    verbs = a_verbs;
+    for(int i = 0; i < index_size; i++)
+        index[i] = -1;
+    for(int i = 0; i < count; i++) {
+        int h = Hash(verbs[i].name, strlen(verbs[i].name));
+        while(index[h] != -1)
+            h = (h + 1) & (index_size - 1);
+        index[h] = i;
+    }
+}
+
+const CommandVerb *CommandTable::Find(const char *word, int len) const
+{
+    if(len < 1)
+        return 0;
+    for(int h = Hash(word, len); index[h] != -1; 
+        h = (h + 1) & (index_size - 1))
+    {
+        const char *name = verbs[(int)index[h]].name;
+        if(0 == strncmp(name, word, len) && name[len] == '\0')
+            return &verbs[(int)index[h]];
+    }
+    return 0;
+}
+
+int CommandTable::Hash(const char *word, int len)
+{
+    unsigned int h = len * 31 + (unsigned char)word[0] * 7 + 
+                     (unsigned char)word[len-1];
+    return h & (index_size - 1);
+}
@@ -0,0 +1,76 @@
+// +-------------------------------------------------------------------------+
+// |                   Manager game server, vers. 0.4.01                     |
+// |    Copyright (c) Andrey Vikt. Stolyarov <avst_AT_cs.msu.ru> 2004-2006   |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                     GNU GENERAL PUBLIC LICENSE, v.2                     |
+// | as published by Free Software Foundation      (see the file COPYING)    |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+
+
+#ifndef CMDLINE_HPP_SENTRY
+#define CMDLINE_HPP_SENTRY
+
+class ScriptVariable;
+
+  // A command line split into words in place: nothing is copied nor
+  // allocated, the words point into the line, so the line must outlive
+  // the object.  Only the first max_words words are remembered; the
+  // rest of the line is still available through AppendWords().
+class CommandLine {
+public:
+    enum { max_words = 16 };
+private:
+    const char *words[max_words];
+    int lens[max_words];
+    int count;
+public:
+    CommandLine(const char *a_line);
+
+    int Length() const { return count; }
+      // the word isn't terminated with '\0', mind the length
+    const char *Word(int i) const { return i < count ? words[i] : ""; }
+    int WordLength(int i) const { return i < count ? lens[i] : 0; }
+    bool Is(int i, const char *s) const;
+      // strtol(3) the whole word, like ScriptVariable::GetLong()
+    bool GetLong(int i, long &l) const;
+      // copy the word terminated with '\0' (empty if there's no such 
+      // word); false if it doesn't fit
+    bool CopyWord(int i, char *buf, int size) const;
+      // append the words from the i-th on, each followed by a space
+    void AppendWords(ScriptVariable &sv, int i) const;
+};
+
+  // A verb of a command language; the flags tell what must hold for 
+  // the command to make sense, their meaning is up to the language
+struct CommandVerb {
+    const char *name;
+    int code;
+    unsigned int flags;
+};
+
+  // Finds the verb of a command in a table fixed at compile time, in
+  // constant time: the verbs are hashed by the length and the first
+  // and the last chars into an open-addressing index built once.
+class CommandTable {
+    enum { index_size = 64 };  // a power of 2, well above the verbs
+    const CommandVerb *verbs;
+    signed char index[index_size];  // position in verbs, or -1
+public:
+    CommandTable(const CommandVerb *a_verbs, int count);
+      // 0 if there's no such verb
+    const CommandVerb *Find(const char *word, int len) const;
+    const CommandVerb *Find(const CommandLine &cmd) const
+        { return Find(cmd.Word(0), cmd.WordLength(0)); }
+private:
+    static int Hash(const char *word, int len);
+};
+
+#endif
@@ -18,10 +18,12 @@
 #include "gamecoll.hpp"
 
 
-GameCollection::GameCollection()
+GameCollection::GameCollection(int *shared_sequence)
 {
     first = 0;
-    sequence = 1;
+    own_sequence = 1;
+    sequence = shared_sequence ? shared_sequence : &own_sequence;
+    runner = 0;
 }
 
 GameCollection::~GameCollection()
@@ -38,7 +40,9 @@ AbstractGameSession* GameCollection::Create(PlayingClient *client,
                                             const char *cmdparm)
 {
     Item *tmp = new Item;
-    ManagerGame *mgame = new ManagerGame(sequence++);
+    int seqnum = __atomic_fetch_add(sequence, 1, __ATOMIC_RELAXED);
+    ManagerGame *mgame = new ManagerGame(seqnum);
+    mgame->SetTaskRunner(runner);
     tmp->game = mgame;
     tmp->next = first;
     first = tmp;
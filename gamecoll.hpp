@@ -25,11 +25,17 @@ class GameCollection {
         Item *next;
     };
     Item *first;
-    int sequence;
+    int own_sequence;
+      // may be shared by collections living in different threads
+    int *sequence;
+    GameTaskRunner *runner;
 public:
-    GameCollection();
+    GameCollection(int *shared_sequence = 0);
     ~GameCollection();
 
+      // games created after the call will do their heavy work with it
+    void SetTaskRunner(GameTaskRunner *r) { runner = r; }
+
     AbstractGameSession* Create(PlayingClient *a_client, const char *gtype);
     AbstractGameSession* Join(PlayingClient *a_client, int gameid);
 
@@ -19,53 +19,165 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
+#include <cxxabi.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "sue/sue_sel.hpp"
 #include "sue/sue_tcps.hpp"
+#include "sue/sue_thr.hpp"
+#include "sue/sue_wait.hpp"
+#include "sue/sue_log.hpp"
 
 #include "scriptpp/scrvar.hpp"
-#include "scriptpp/scrvect.hpp"
 
 #include "session.hpp"
+#include "cmdline.hpp"
 #include "gamecoll.hpp"
 
 /*const*/ int the_server_port = 4774;
 const int the_server_timeout = 3600;
 const int max_name_length = 16;
+  // a tournament announcement brings everyone back at once
+const int the_listen_backlog = 2048;
+  // output queued for a client who doesn't read it: above the high
+  // mark we stop reading her and skip the chat for her until it drains
+  // to the low mark; above the hard limit she's disconnected
+const int the_output_high_mark = 256*1024;
+const int the_output_low_mark = 64*1024;
+const int the_output_hard_limit = 4*1024*1024;
+  // 0 means the main thread serves all the sessions by itself
+int the_reactor_threads = 0;
+  // more than 1 means to fork worker processes sharing the port
+int the_worker_processes = 0;
+  // how many users may be logged in at once, see Lobby
+const int the_max_names = 65536;
+const int the_name_buckets = 65536;  // must be a power of 2
+SUEEventSelector::Backend the_backend = SUEEventSelector::backend_default;
+  // 0 means stderr; worker processes add ".wN" to the name
+const char *the_log_file = 0;
+const long the_log_max_size = 16*1024*1024;
+const int the_log_keep = 5;
+const SUELogger::Level the_log_level = SUELogger::log_info;
+
+SUELogger the_log;
 
 
 class ChatServer;
+class ChatShard;
+class ShardMessage;
+class ShardLink;
+class RemoteGame;
+
+  // what the thread of a player needs to know about her game session
+  // which lives in another thread
+struct GameSessionState {
+    bool chat_accepted;
+    int gameid;
+    char status[32];
+
+    void Fetch(const AbstractGameSession *sess);
+};
+
+  // What all the shards share: the names are global, and so are the 
+  // serials of the sessions and the numbers of the games.  This lives
+  // in memory shared by the worker processes, if any, and is guarded
+  // by a process-shared lock.
+struct Lobby {
+    struct NameSlot {
+        char name[max_name_length+1];
+        int shard;       // -1 for a slot not in use
+        unsigned long serial;
+        int next;  // the next slot of the same bucket (or free), or -1
+    };
+    pthread_mutex_t lock;
+    int game_sequence;
+    unsigned long lastserial;
+    int firstfree;   // the slots released
+    int unused;      // the slots from here on were never used
+      // the first slots of the names hashed to each bucket, or -1
+    int buckets[the_name_buckets];
+    NameSlot names[the_max_names];
+
+    static Lobby *Create();
+    void Lock();
+    void Unlock() { pthread_mutex_unlock(&lock); }
+      // the lock must be held for these
+    int Find(const char *name) const;
+    bool Add(const char *name, int shard, unsigned long serial);
+    void Remove(const char *name);
+      // the process serving the shard is gone, and so are its sessions
+    void ReleaseShard(int shard);
+private:
+    static int Bucket(const char *name);
+};
 
 class ChatServerSession : public SUETcpServerSession, public PlayingClient {
-    ChatServer *the_server;
+    ChatShard *the_shard;
+    unsigned long serial;
     char *name;
     AbstractGameSession *session;
+      // the same as session if the game lives in another thread
+    RemoteGame *remote;
+      // .join is being served by other threads
+    bool joining;
+      // chat messages skipped because of the output congestion
+    int chatskipped;
+      // our position among the chat subscribers of the shard, or -1
+    int chatslot;
 public:
     ChatServerSession(int a_fd, int a_timeout, 
                       SUEEventSelector *a_selector,
-                      ChatServer *a_server);
+                      ChatServer *a_server, ChatShard *a_shard);
     ~ChatServerSession();
 
     /* from TcpServerSession */
     virtual void HandleNewInput();
     virtual void TcpServerSessionShutdownHook(); 
     virtual void HandleSessionTimeout();
+    virtual void HandleOutputCongestion(bool congested);
 
     /* from PlayingClient */
     virtual void Print(const char *msg) { Send(msg); }
+    virtual void PrintBroadcast(BroadcastText &text);
     virtual void Broadcast(const char *);
     virtual const char *GetName() const { return name; }
+    virtual void ChatStateChanged() { UpdateChat(); }
 
     void Send(const char *message);
+      // the same message for many sessions, sent without copying
+    void Send(SUEPayload *message);
 
     const char *GetStatus() const 
         { return session ? session->GetStatus() : "[relaxing]"; }
 
-    void ChatSend(const char *message) 
-        { if(!session||session->ChatAccepted()) Send(message); }
+    void ChatSend(SUEPayload *message);
+      // (un)subscribe to the global chat as the name and the game say;
+      // must be done before any event on the change is sent
+    void UpdateChat();
+    int GetChatSlot() const { return chatslot; }
+    void SetChatSlot(int slot) { chatslot = slot; }
 
     int GameId() const { return session ? session->GameId() : 0; }
 
+      // unique for the whole server, unlike the descriptor
+    unsigned long GetSerial() const { return serial; }
+
+    /* replies from other threads */
+    bool IsJoining() const { return joining; }
+    void JoinLocalGame(int gameid);
+    void RemoteJoinDone(const ShardMessage *msg);
+    void RemoteGameOutput(const ShardMessage *msg);
+    void RemoteGameLeft(int gameid);
+      // the worker serving the shard is gone
+    void ShardDown(ChatShard *dead);
+
 #if 0
     const char *GetStatus() const 
         { return session ? session->GetStatus() : "[relaxing]"; }
@@ -76,68 +188,376 @@ private:
     virtual void SendMessage(const char *msg) { Send(msg); }
 #endif
     void ProcessCommand(const char *);
+    void ReportStats();
 };
 
 
+  // A request passed from one thread to another.  Please note the 
+  // text must never share its buffer with any other ScriptVariable 
+  // because ScriptVariable's reference counter is not thread-safe.
+class ShardMessage : public SUEMessage {
+public:
+    enum Kind {
+        chat, chat_urgent, tell,
+        list_request, list_reply,
+        join_request, join_reply,
+        game_command, game_output, game_left, game_detach
+    };
+    Kind kind;
+    ChatShard *to;
+    ChatShard *from;
+    unsigned long serial;    // the session the request is on behalf of
+    unsigned long peer;      // another session involved, if any
+    char name[max_name_length+1];
+    ScriptVariable text;
+      // the chat message, shared by all the threads
+    SUEPayload *payload;
+    int gameid;
+    int hops;
+    bool ok;
+    bool has_state;
+    GameSessionState state;
+    int count, games;
+    struct ListQuery *query;
+
+    ShardMessage(Kind k, ChatShard *a_to, ChatShard *a_from);
+    ~ShardMessage() { if(payload) payload->Release(); }
+    virtual void Deliver();
+};
 
-class ChatServer : public SUETcpServer {
+
+  // Stands for a player of another thread in a game of this thread
+class RemotePlayer : public PlayingClient {
+    friend class ChatShard;
+    ChatShard *host;
+    ChatShard *home;
+    unsigned long serial;
+    char name[max_name_length+1];
+    AbstractGameSession *session;
+    RemotePlayer *next;
+public:
+    RemotePlayer(ChatShard *a_host, const ShardMessage *join);
+    ~RemotePlayer() { if(session) delete session; }
+
+    virtual void Print(const char *msg);
+    virtual void Broadcast(const char *msg);
+    virtual const char *GetName() const { return name; }
+};
+
+  // Stands for a game of another thread in the session of a player
+class RemoteGame : public AbstractGameSession {
+    ChatShard *home;
+    ChatShard *host;
+    unsigned long serial;
+    GameSessionState state;
+    bool left;
+public:
+    RemoteGame(ChatServerSession *a_client, ChatShard *a_home, 
+               const ShardMessage *reply);
+    ~RemoteGame();
+
+    virtual void HandleCommand(const char *cmd);
+    virtual bool ChatAccepted() const { return state.chat_accepted; }
+    virtual int GameId() const { return state.gameid; }
+    virtual const char *GetStatus() const { return state.status; }
+    virtual bool ZombieState() const { return left; }
+
+    ChatShard *Host() const { return host; }
+    void Update(const GameSessionState &st) { state = st; }
+      // the game thread has already forgotten us
+    void Left() { left = true; }
+};
+
+
+  // The channel to the shard of another worker process: the messages
+  // posted to that shard are written here, and the messages it posts
+  // to the shard of ours are read from here
+class ShardLink : public SUEGenericDuplexSession {
+    ChatServer *the_server;
+    int peer;
+    bool up;
+public:
+    ShardLink(int fd, int a_peer, SUEEventSelector *a_selector);
+
+      // 0 detaches, so the shutdown is not reported to anyone
+    void Attach(ChatServer *a_server) { the_server = a_server; }
+    void Send(const ShardMessage *msg);
+    bool IsUp() const { return up; }
+
+private:
+    virtual void HandleNewInput();
+    virtual void ShutdownHook();
+};
+
+
+  // Sessions and games served by one thread
+class ChatShard : public GameTaskRunner {
+    ChatServer *the_server;
+    int index;
+    SUEEventSelector *the_selector;
+    SUEReactorThread *the_thread;
+      // the shard of another worker process, see ShardLink
+    ShardLink *link;
     struct Item {
         ChatServerSession *sess;
-        Item *next;
+        Item *next, *prev;
+        Item *nextbyserial;  // the next one in the same bucket
     }; 
     Item *first;
+      // the sessions hashed by the serials, which go in sequence, so
+      // the lower bits are just what we need
+    Item **byserial;
+    int byserialsize;  // a power of 2
+    int sessioncount;
+      // the sessions the global chat goes to, see SetChatSubscriber()
+    ChatServerSession **chatters;
+    int chattercount, chattersize;
+      // heavy work of the games, done in slices as deferred tasks
+    class GameTaskSlot *tasks;
+    GameCollection collection;
+      // players from other threads in the games of this one
+    RemotePlayer *remote_players;
+      // .who still collected
+    ListQuery *queries;
+
+public:
+    ChatShard(SUEEventSelector *a_selector, int *game_sequence);
+    ChatShard(SUEReactorThread *a_thread, int *game_sequence);
+      // stands for the shard of another process in this one
+    ChatShard(ShardLink *a_link);
+    ~ChatShard();
+
+    void Attach(ChatServer *a_server, int a_index);
+    ChatServer *GetServer() const { return the_server; }
+    SUEEventSelector *GetSelector() const { return the_selector; }
+    SUEReactorThread *GetThread() const { return the_thread; }
+    bool IsRemote() const { return link != 0; }
+      // the worker process serving the shard is gone
+    bool IsDown() const { return link && !link->IsUp(); }
+    int Index() const { return index; }
+      // the next shard which is not down, or this one
+    ChatShard *Next() const;
+
+      // may be called by any thread
+    void Post(ShardMessage *msg);
+
+    ChatServerSession *NewSession(int fd, int timeout);
+    void ExcludeSession(ChatServerSession *sess);
+    ChatServerSession *FindBySerial(unsigned long serial) const;
+      // the global chat is only sent to the sessions subscribed, so it
+      // costs nothing to those who don't accept it
+    void SetChatSubscriber(ChatServerSession *sess, bool on);
+
+    void SendMessage(const char *name, const char *message);
+    void SendEvent(const char *name, const char *event);
+    void Broadcast(const char *msg);
+      // the part of a global chat message delivery done by this thread
+    void Chat(SUEPayload *msg, bool urgent);
+
+    void Tell(ChatShard *where, unsigned long to, const char *msg);
+    void RequestList(ChatServerSession *sess);
+    void RequestJoin(ChatServerSession *sess, int gameid, 
+                     ChatShard *where, unsigned long nickowner);
+      // nothing will ever come from the dead shard
+    void ShardDown(ChatShard *dead);
+
+    AbstractGameSession *CreateGame(ChatServerSession *sess,
+                                    const char *gametype)
+        { return collection.Create(sess, gametype); }
+    bool HasGame(int gameid) 
+        { return collection.GetGame(gameid) != 0; }
+    AbstractGameSession *JoinGame(ChatServerSession *sess, int gameid)
+        { return collection.Join(sess, gameid); }
+    void RemoveZombieGames() { collection.RemoveZombies(); }
+
+    /* from GameTaskRunner */
+    virtual void StartTask(GameTask *task);
+    virtual void StopTask(GameTask *task);
+    void TaskDone(GameTaskSlot *slot);
+
+    void Receive(ShardMessage *msg);
+private:
+    void ListSessions(ScriptVariable &out, int &count) const;
+    void CollectList(ListQuery *q, ChatShard *from, 
+                     const char *text, int count, int games);
+    void Bounce(const ShardMessage *msg);
+    void ServeJoin(ShardMessage *msg);
+    void ServeGameCommand(const ShardMessage *msg);
+    RemotePlayer *FindRemotePlayer(unsigned long serial) const;
+    void DropRemotePlayer(RemotePlayer *rp);
+    void InitSessions();
+    void IndexItem(Item *item);
+};
+
+
+class ChatServer : public SUETcpServer {
+    ChatShard **shards;
+    int shardcount;
 
     int timeout;
 
-    GameCollection *the_collection;
+    Lobby *lobby;
 
 public:
-    ChatServer(int a_port, int a_timeout, GameCollection *coll);
+    ChatServer(int a_port, int a_timeout, Lobby *a_lobby);
     ~ChatServer();
 
+    void AddShard(ChatShard *shard);
+    int ShardCount() const { return shardcount; }
+    ChatShard *GetShard(int idx) const { return shards[idx]; }
+
     virtual SUETcpServerSession* SpawnSession(int newsessionfd);
+    virtual SUETcpServerSession* SpawnReactorSession(int newsessionfd,
+                                            SUEEventSelector *a_selector);
 
-    void SendMessage(const char *name, const char *message);
-    void SendEvent(const char *name, const char *event);
-    void Broadcast(const char *msg) { Send(msg, true); }
-    void ExcludeSession(ChatServerSession *sess);
+    unsigned long NewSerial() {
+        return __atomic_add_fetch(&lobby->lastserial, 1, __ATOMIC_RELAXED);
+    }
 
-    bool IsNameAvailable(const char *name) const;
-    void SendMeList(ChatServerSession *sess) const;
-    ChatServerSession* FindByName(const char *name) const;
+    bool ClaimName(const char *name, ChatShard *shard, 
+                   unsigned long serial);
+    void ReleaseName(const char *name);
+    bool FindByName(const char *name, 
+                    ChatShard *&shard, unsigned long &serial);
 
-    AbstractGameSession *CreateGame(ChatServerSession *sess,
-                                    const char *gametype)
-        { return the_collection->Create(sess, gametype); }
-    AbstractGameSession *JoinGame(ChatServerSession *sess,
-                                  int gameid)
-        { return the_collection->Join(sess, gameid); }
+    void Send(ChatShard *from, const char *msg, bool urgent = false);
+      // the worker serving the shard is gone; the worker processes 
+      // have no threads, so the shards of ours are told right away
+    void ShardDown(int idx);
+};
 
 
-    void RemoveZombieGames() const { the_collection->RemoveZombies(); }
-private:
-    void Send(const char *msg, bool urgent = false);
-};
 
 
 
+void GameSessionState::Fetch(const AbstractGameSession *sess)
+{
+    chat_accepted = sess->ChatAccepted();
+    gameid = sess->GameId();
+    strncpy(status, sess->GetStatus(), sizeof(status)-1);
+    status[sizeof(status)-1] = 0;
+}
+
+
+
+Lobby *Lobby::Create()
+{
+    void *mem = mmap(0, sizeof(Lobby), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+        throw "couldn't map the shared memory";
+    Lobby *lobby = (Lobby*)mem;   // zeroed by the kernel
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      // a worker may die holding the lock
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&lobby->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    lobby->game_sequence = 1;
+    lobby->lastserial = 0;
+    lobby->firstfree = -1;
+    lobby->unused = 0;
+    for(int i = 0; i < the_name_buckets; i++)
+        lobby->buckets[i] = -1;
+    return lobby;
+}
+
+void Lobby::Lock()
+{
+    if(pthread_mutex_lock(&lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&lock);
+}
+
+  // FNV-1a
+int Lobby::Bucket(const char *name)
+{
+    unsigned int h = 2166136261u;
+    for(; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h & (the_name_buckets - 1);
+}
+
+int Lobby::Find(const char *name) const
+{
+    for(int i = buckets[Bucket(name)]; i != -1; i = names[i].next)
+        if(strcmp(names[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+bool Lobby::Add(const char *name, int shard, unsigned long serial)
+{
+    int i;
+    if(firstfree != -1) {
+        i = firstfree;
+        firstfree = names[i].next;
+    } else 
+    if(unused < the_max_names) {
+        i = unused++;
+    } else {
+        return false;
+    }
+    strncpy(names[i].name, name, max_name_length);
+    names[i].name[max_name_length] = 0;
+    names[i].shard = shard;
+    names[i].serial = serial;
+    int b = Bucket(names[i].name);
+    names[i].next = buckets[b];
+    buckets[b] = i;
+    return true;
+}
+
+void Lobby::Remove(const char *name)
+{
+    for(int *p = &buckets[Bucket(name)]; *p != -1; p = &names[*p].next) {
+        int i = *p;
+        if(strcmp(names[i].name, name) == 0) {
+            *p = names[i].next;
+            names[i].shard = -1;
+            names[i].next = firstfree;
+            firstfree = i;
+            return;
+        }
+    }
+}
+
+void Lobby::ReleaseShard(int shard)
+{
+    Lock();
+    for(int i = 0; i < unused; i++)
+        if(names[i].shard == shard)
+            Remove(names[i].name);
+    Unlock();
+}
+
 
 
 ChatServerSession::ChatServerSession(int a_fd, int a_timeout, 
 	      SUEEventSelector *a_selector,
-	      ChatServer *a_server)
+	      ChatServer *a_server, ChatShard *a_shard)
 : SUETcpServerSession(a_fd, a_timeout, a_selector, a_server, 
 		    "Please enter your name: ")
 { 
     name = 0; 
     session = 0;
-    the_server = a_server; 
+    remote = 0;
+    joining = false;
+    chatskipped = 0;
+    chatslot = -1;
+    the_shard = a_shard; 
+    serial = a_server->NewSerial();
 
       // we want to time out the users who don't type anything in
     inputresetstimeout = true;
       // when a user gets a message (as opposit to _sending_ a message),
       // it doesn't affect her idle time counter
     outputresetstimeout = false;
+
+    SetOutputLimits(the_output_high_mark, the_output_low_mark,
+                    output_stop_reading, the_output_hard_limit);
 }
 
 ChatServerSession::~ChatServerSession() 
@@ -160,30 +580,31 @@ static bool check_login_name(const char *c)
 
 void ChatServerSession::HandleNewInput() 
 {   
-    SUEBuffer ln;
-    while(inputbuffer.ReadLine(ln)) {
+      // the lines are handled right in the inputbuffer
+    int pos = 0, len;
+    while(char *ln = inputbuffer.NextLine(pos, len)) {
         if(!name) {
-            if(ln.Length()<3) { // 3 is for one char, <LF> and <0>
+            if(len<2) {
                 outputbuffer.AddString("%- Name too short.\n"
                                        "Please enter your name: ");
             } else
-            if(ln.Length()>max_name_length+2) { // 2 is for <LF> and <0>
+            if(len>max_name_length) {
                 outputbuffer.AddString("%- Name too long.\n"
                                        "Please enter your name: ");
             } else 
             {
-	        char *str = new char[ln.Length()+1];
-	        strncpy(str, ln.GetBuffer(), ln.Length());
-                str[ln.Length()] = 0;
+	        char *str = new char[len+1];
+	        memcpy(str, ln, len+1);
 		if(!check_login_name(str)) {
                     outputbuffer.AddString("%- Bad symbols in the name "
                                    "(only letters and digits are allowed)\n"
                                            "Please enter your name: ");
                     delete[] str;
 		} else
-                if(the_server->IsNameAvailable(str)) {
+                if(the_shard->GetServer()->ClaimName(str, the_shard, serial)) {
                     name = str;
-	            the_server->SendEvent(name, "has entered the chat room");
+                    UpdateChat();
+	            the_shard->SendEvent(name, "has entered the chat room");
                     outputbuffer.AddString("% Type .help for help\n");
                 } else {
                     outputbuffer.AddString("%- Name is not available "
@@ -194,13 +615,9 @@ void ChatServerSession::HandleNewInput()
             }
         } else 
         if(session && ln[0]!='.') {
-            session->HandleCommand(ln.GetBuffer()); 
+            session->HandleCommand(ln); 
         } else {
-            // Since we've made a successful ReadLine, there's at least
-            // one byte in the buffer ('\n')
             switch(ln[0]) {
-                case '\r':
-                case '\n':
                 case '\0':
                     Send("% Your name is ");
                     Send(name);
@@ -209,38 +626,40 @@ void ChatServerSession::HandleNewInput()
                          "% Type something else than a command to talk\n");
                     break;
                 case '.':
-                    ProcessCommand(ln.GetBuffer());
+                    ProcessCommand(ln);
                     break;                    
                 default:
-	            the_server->SendMessage(name, ln.GetBuffer());
+	            the_shard->SendMessage(name, ln);
             }
         }
     }
+    inputbuffer.DropData(pos);
     if(session && session->ZombieState()) {
         delete session;
         session = 0;
-        the_server->SendEvent(name, 
+        UpdateChat();
+        the_shard->SendEvent(name, 
             "has left a game and returned to the chat room");
-        the_server->RemoveZombieGames();
+        the_shard->RemoveZombieGames();
     }
 }
 
 void ChatServerSession::HandleSessionTimeout() 
 {
-    the_server->SendEvent(name, "timed out");
+    the_shard->SendEvent(name, "timed out");
     GracefulShutdown();
 }
 
 void ChatServerSession::TcpServerSessionShutdownHook() 
 {
-    the_server->ExcludeSession(this);
+    the_shard->ExcludeSession(this);
     if(name) 
-        the_server->SendEvent(name, "has left the chat room");
+        the_shard->SendEvent(name, "has left the chat room");
 }
 
 void ChatServerSession::Broadcast(const char *message)
 {
-    the_server->Broadcast(message);
+    the_shard->Broadcast(message);
 }
 
 void ChatServerSession::Send(const char *message)
@@ -248,17 +667,162 @@ void ChatServerSession::Send(const char *message)
     if(name) outputbuffer.AddString(message);
 }
 
+void ChatServerSession::Send(SUEPayload *message)
+{
+    if(name) QueuePayload(message);
+}
+
+void ChatServerSession::ChatSend(SUEPayload *message)
+{
+    if(IsOutputCongested()) {
+          // she isn't reading anyway; the chat is the first to go
+        chatskipped++;
+        return;
+    }
+    Send(message);
+}
+
+void ChatServerSession::HandleOutputCongestion(bool congested)
+{
+    if(congested || !chatskipped)
+        return;
+    ScriptVariable msg(100, 
+        "%%- %d chat messages skipped while you weren't reading\n",
+        chatskipped);
+    Send(msg.c_str());
+    chatskipped = 0;
+}
+
+  // made by the first of our sessions a game broadcast reaches
+class SharedPayload : public BroadcastText::SharedCopy {
+public:
+    SUEPayload *payload;
+    SharedPayload(const char *text) : payload(new SUEPayload(text)) {}
+    ~SharedPayload() { payload->Release(); }
+};
+
+void ChatServerSession::PrintBroadcast(BroadcastText &text)
+{
+    SharedPayload *copy = dynamic_cast<SharedPayload*>(text.GetCopy());
+    if(!copy) {
+        if(text.GetCopy()) {
+              // someone else has made a copy of its own
+            Send(text.c_str());
+            return;
+        }
+        copy = new SharedPayload(text.c_str());
+        text.SetCopy(copy);
+    }
+    Send(copy->payload);
+}
+
+void ChatServerSession::UpdateChat()
+{
+    the_shard->SetChatSubscriber(this, 
+                                 name && (!session || session->ChatAccepted()));
+}
+
+void ChatServerSession::JoinLocalGame(int gmid)
+{
+    joining = false;
+    session = the_shard->JoinGame(this, gmid);
+    if(!session) 
+        outputbuffer.AddString("%- Couldn't join the game\n");
+    else {
+        UpdateChat();
+        the_shard->SendEvent(name, "joined a game");
+    }
+}
+
+void ChatServerSession::RemoteJoinDone(const ShardMessage *msg)
+{
+    joining = false;
+    if(!msg->ok) {
+        outputbuffer.AddString(msg->text.c_str());
+        return;
+    }
+    remote = new RemoteGame(this, the_shard, msg);
+    session = remote;
+    UpdateChat();
+    the_shard->SendEvent(name, "joined a game");
+}
+
+void ChatServerSession::RemoteGameOutput(const ShardMessage *msg)
+{
+    if(remote && msg->has_state && remote->GameId() == msg->state.gameid) {
+        remote->Update(msg->state);
+        UpdateChat();
+    }
+    Send(msg->text.c_str());
+}
 
-#define MUST_BE_RELAXING \
-    if(session) {\
-        outputbuffer.AddString("%- You can't do that while playing a game\n");\
-        return;\
+void ChatServerSession::RemoteGameLeft(int gameid)
+{
+    if(!remote || remote->GameId() != gameid)
+        return;
+    remote->Left();
+    delete session;
+    session = 0;
+    remote = 0;
+    UpdateChat();
+    the_shard->SendEvent(name, 
+        "has left a game and returned to the chat room");
+}
+
+  // the .join might have been lost with the worker, so we don't wait 
+  // for it; if the reply comes after all, it is ignored
+void ChatServerSession::ShardDown(ChatShard *dead)
+{
+    if(joining) {
+        joining = false;
+        outputbuffer.AddString("%- Couldn't join the game\n");
+    }
+    if(remote && remote->Host() == dead) {
+        outputbuffer.AddString("%- The game is lost\n");
+        RemoteGameLeft(remote->GameId());
     }
+}
+
+
+  // what a command needs
+enum {
+    cmdf_relaxing = 0x01   // the player is not in a game
+};
+
+enum {
+    lc_help, lc_quit, lc_create, lc_join, lc_who, lc_stats, lc_tell, lc_say
+};
+
+static const CommandVerb lobby_verbs[] = {
+    { ".help",   lc_help,   0 },
+    { ".quit",   lc_quit,   0 },
+    { ".create", lc_create, cmdf_relaxing },
+    { ".join",   lc_join,   cmdf_relaxing },
+    { ".who",    lc_who,    0 },
+    { ".stats",  lc_stats,  0 },
+    { ".tell",   lc_tell,   0 },
+    { ".say",    lc_say,    0 }
+};
+
+static const CommandTable lobby_commands(lobby_verbs,
+                                  sizeof(lobby_verbs)/sizeof(*lobby_verbs));
 
-void ChatServerSession::ProcessCommand(const char *cmd)
+void ChatServerSession::ProcessCommand(const char *a_cmd)
 {
-    ScriptVector cmdline(cmd);
-    if(cmdline[0]==".help") {
+    CommandLine cmd(a_cmd);
+    const CommandVerb *verb = lobby_commands.Find(cmd);
+    if(!verb) {
+        outputbuffer.AddString("%- Unknown command [");
+        outputbuffer.AddData(cmd.Word(0), cmd.WordLength(0));
+        outputbuffer.AddString("]\n");
+        return;
+    }
+    if((verb->flags & cmdf_relaxing) && (session || joining)) {
+        outputbuffer.AddString("%- You can't do that while playing a game\n");
+        return;
+    }
+    switch(verb->code) {
+    case lc_help:
         outputbuffer.AddString(
         "% .who                    - list who's on\n"
         "% .tell <nick> <message>  - send a private message\n"
@@ -266,43 +830,46 @@ void ChatServerSession::ProcessCommand(const char *cmd)
         "% .create                 - create new game\n"
         "% .join N                 - join the game #N\n"
         "% .join <nick>            - join the game where <nick> plays\n"
+        "% .stats                  - main loop statistics of this thread\n"
         "% .quit                   - quits the server\n"
         "% .help                   - prints this help\n"
         ); 
-    } else
-    if(cmdline[0]==".quit") {
+        break;
+    case lc_quit:
         outputbuffer.AddString("% Bye-bye\n");
-#if 0
-        if(session) {
-            int gmid = session->GameId();
-            AbstractGame* game = the_collection->GetGame(gmid);
-            if(game)
-                game->PlayerQuit(session);
-        }
-        if(session) {
-            session->ClientDead();
-            session = 0;
-        }
-#endif
         GracefulShutdown(); 
-    } else 
-    if(cmdline[0]==".create") {
-        MUST_BE_RELAXING
-        session = the_server->CreateGame(this, cmdline[1].c_str());
+        break;
+    case lc_create: {
+        ScriptVariable gametype(0, "%.*s", cmd.WordLength(1), cmd.Word(1));
+        session = the_shard->CreateGame(this, gametype.c_str());
         if(!session) 
             outputbuffer.AddString("%- Couldn't create a game\n");
         else {
+            UpdateChat();
 	    ScriptVariable sv(30, "has created the game #%d", 
                                   session->GameId());
-            the_server->SendEvent(name, sv.c_str());
+            the_shard->SendEvent(name, sv.c_str());
 	}
-    } else 
-    if(cmdline[0]==".join") {
-        MUST_BE_RELAXING
+        break;
+    }
+    case lc_join: {
         long gmid;
-        if(!cmdline[1].GetLong(gmid)) {
-            ChatServerSession *nickowner = 
-                the_server->FindByName(cmdline[1].c_str());
+        if(!cmd.GetLong(1, gmid)) {
+            ChatShard *where;
+            unsigned long who;
+            char nick[max_name_length+1];
+            if(!cmd.CopyWord(1, nick, sizeof(nick)) ||
+               !the_shard->GetServer()->FindByName(nick, where, who)) 
+            {
+                outputbuffer.AddString("%- No such nick\n");
+                return;
+            }
+            if(where != the_shard) {
+                joining = true;
+                the_shard->RequestJoin(this, 0, where, who);
+                return;
+            }
+            ChatServerSession *nickowner = the_shard->FindBySerial(who);
             if(!nickowner) {
                 outputbuffer.AddString("%- No such nick\n");
                 return;
@@ -313,143 +880,646 @@ void ChatServerSession::ProcessCommand(const char *cmd)
                 return;
             }
         }
-        session = the_server->JoinGame(this, gmid);
-        if(!session) 
-            outputbuffer.AddString("%- Couldn't join the game\n");
-        else 
-            the_server->SendEvent(name, "joined a game");
-    } else 
-    if(cmdline[0]==".who") {
-        the_server->SendMeList(this);
-    } else 
-    if(cmdline[0]==".tell") {
-        ChatServerSession *to = the_server->FindByName(cmdline[1].c_str());
-        if(!to) {
+        if(!the_shard->HasGame(gmid) && 
+           the_shard->GetServer()->ShardCount() > 1) 
+        {
+            joining = true;
+            the_shard->RequestJoin(this, gmid, the_shard->Next(), 0);
+            return;
+        }
+        JoinLocalGame(gmid);
+        break;
+    }
+    case lc_who:
+        the_shard->RequestList(this);
+        break;
+    case lc_stats:
+        ReportStats();
+        break;
+    case lc_tell: {
+        ChatShard *where;
+        unsigned long to;
+        char nick[max_name_length+1];
+        if(!cmd.CopyWord(1, nick, sizeof(nick)) ||
+           !the_shard->GetServer()->FindByName(nick, where, to)) 
+        {
             outputbuffer.AddString("%- No such nick \n");
             return;
         }
         ScriptVariable msg("* ");
         msg+=name;
         msg+=" tells you: ";
-        for(int i=2; i<cmdline.Length(); i++) {
-            msg += cmdline[i];
-            msg += " ";
-        }
+        cmd.AppendWords(msg, 2);
         msg += "\n";
-        to->Send(msg.c_str());
+        the_shard->Tell(where, to, msg.c_str());
         outputbuffer.AddString("% OK\n");
-    } else 
-    if(cmdline[0]==".say") {
+        break;
+    }
+    case lc_say: {
         if(session && !session->ChatAccepted()) {
             outputbuffer.AddString("%- Enable global chat to do this\n");
             return;
         }
         ScriptVariable msg;
-        for(int i=1; i<cmdline.Length(); i++) {
-            msg += cmdline[i];
-            msg += " ";
-        }
-        the_server->SendMessage(name, msg.c_str());
+        cmd.AppendWords(msg, 1);
+        the_shard->SendMessage(name, msg.c_str());
         outputbuffer.AddString("% OK\n");
-    } else 
-    {
-        outputbuffer.AddString("%- Unknown command [");
-        outputbuffer.AddString(cmdline[0].c_str());
-        outputbuffer.AddString("]\n");
+        break;
+    }
     }
     if(session && session->ZombieState()) {
         delete session;
         session = 0;
-        the_server->SendEvent(name, 
+        UpdateChat();
+        the_shard->SendEvent(name, 
             "has left a game and returned to the chat room");
     }
 }
-#undef MUST_BE_RELAXING
 
+static void add_histogram(SUEBuffer &buf, const char *title,
+                          const unsigned long long *hist)
+{
+    buf.AddString("% ");
+    buf.AddString(title);
+    for(int i = 0; i < SUESelectorStats::histogram_size; i++) {
+        if(!hist[i])
+            continue;
+        ScriptVariable item(60, " %llu:%llu", 
+                            i ? 1ULL << (i-1) : 0ULL, hist[i]);
+        if(i == SUESelectorStats::histogram_size - 1)
+            item = ScriptVariable(60, " %llu+:%llu", 1ULL << (i-1), hist[i]);
+        else if(i > 1)
+            item = ScriptVariable(60, " %llu-%llu:%llu", 
+                                  1ULL << (i-1), (1ULL << i) - 1, hist[i]);
+        buf.AddString(item.c_str());
+    }
+    buf.AddString("\n");
+}
 
+void ChatServerSession::ReportStats()
+{
+    ScriptVariable queued(100, "%% %lld bytes queued for sending, "
+                          "%lld bytes of idle buffer memory\n",
+                          SUEGenericDuplexSession::TotalOutputLength(),
+                          the_selector->GetBufferPool()->IdleBytes());
+    outputbuffer.AddString(queued.c_str());
+    SUESelectorStats st;
+    the_selector->GetStats(st);
+    if(!st.enabled) {
+        outputbuffer.AddString("%- Statistics are not compiled in\n");
+        return;
+    }
+    ScriptVariable line(200, 
+        "%% %llu iterations, %.3f s blocked, the longest took %llu us\n"
+        "%% %llu descriptors ready, %llu timeouts fired, "
+        "loop hooks took %.3f s\n",
+        st.iterations, st.blocked_ns / 1e9, 
+        st.longest_iteration_ns / 1000, 
+        st.ready_fds, st.timeouts_fired, st.hooks_ns / 1e9);
+    outputbuffer.AddString(line.c_str());
+    line = ScriptVariable(200, 
+        "%% %llu deferred tasks took %.3f s, "
+        "%llu iterations left some for later\n",
+        st.tasks_run, st.tasks_ns / 1e9, st.tasks_rolled_over);
+    outputbuffer.AddString(line.c_str());
+    add_histogram(outputbuffer, "waits (us):", st.blocked_hist);
+    add_histogram(outputbuffer, "ready per wakeup:", st.ready_hist);
+    add_histogram(outputbuffer, "timeouts per iteration:", st.timeouts_hist);
+    for(int i = 0; i < st.classescount; i++) {
+        const SUESelectorStats::HandlerClass &c = st.classes[i];
+        int status;
+        char *demangled = 
+            c.name ? abi::__cxa_demangle(c.name, 0, 0, &status) : 0;
+        ScriptVariable cls(200, 
+            "%% %s: %llu calls, %.3f s, the longest took %llu us\n",
+            demangled ? demangled : c.name ? c.name : "(others)",
+            c.calls, c.total_ns / 1e9, c.max_ns / 1000);
+        free(demangled);
+        outputbuffer.AddString(cls.c_str());
+    }
+}
 
 
 
 
+ShardMessage::ShardMessage(Kind k, ChatShard *a_to, ChatShard *a_from)
+{
+    kind = k;
+    to = a_to;
+    from = a_from;
+    serial = 0;
+    peer = 0;
+    name[0] = 0;
+    gameid = 0;
+    hops = 0;
+    ok = false;
+    has_state = false;
+    count = 0;
+    games = 0;
+    query = 0;
+    payload = 0;
+}
 
-ChatServer::ChatServer(int a_port, int a_timeout, GameCollection *coll)
-    : SUETcpServer("0.0.0.0", a_port)
+void ShardMessage::Deliver()
 {
-    first = 0;
-    timeout = a_timeout;
-    the_collection = coll;
+    to->Receive(this);
 }
 
-ChatServer::~ChatServer()
+
+
+  // a ShardMessage as it goes between the processes; the text follows,
+  // then the payload (if any) up to the length
+struct ShardWireHeader {
+    int length;
+    int kind;
+    int to, from;  // the indices of the shards
+    unsigned long serial, peer;
+    char name[max_name_length+1];
+    int gameid;
+    int hops;
+    bool ok;
+    bool has_state;
+    GameSessionState state;
+    int count, games;
+    uintptr_t query;  // only means something to the process it's from
+    int textlen;
+};
+
+ShardLink::ShardLink(int fd, int a_peer, SUEEventSelector *a_selector)
+{
+    the_server = 0;
+    peer = a_peer;
+    up = true;
+    Startup(a_selector, fd);
+}
+
+void ShardLink::Send(const ShardMessage *msg)
+{
+    if(!up)
+        return;  // the peer is gone, and so is whatever this was for
+    ShardWireHeader h;
+    memset(&h, 0, sizeof(h));
+    h.textlen = msg->text.Length();
+    h.length = sizeof(h) + h.textlen + 
+        (msg->payload ? msg->payload->Length() : 0);
+    h.kind = msg->kind;
+    h.to = msg->to->Index();
+    h.from = msg->from->Index();
+    h.serial = msg->serial;
+    h.peer = msg->peer;
+    memcpy(h.name, msg->name, sizeof(h.name));
+    h.gameid = msg->gameid;
+    h.hops = msg->hops;
+    h.ok = msg->ok;
+    h.has_state = msg->has_state;
+    h.state = msg->state;
+    h.count = msg->count;
+    h.games = msg->games;
+    h.query = (uintptr_t)msg->query;
+    outputbuffer.AddData((const char*)&h, sizeof(h));
+    outputbuffer.AddData(msg->text.c_str(), h.textlen);
+    if(msg->payload)
+        QueuePayload(msg->payload);  // the chat goes without copying
+}
+
+void ShardLink::HandleNewInput()
+{
+    while(inputbuffer.Length() >= (int)sizeof(ShardWireHeader)) {
+        ShardWireHeader h;
+        memcpy(&h, inputbuffer.GetBuffer(), sizeof(h));
+        int shards = the_server->ShardCount();
+        if(h.length < (int)sizeof(h) + h.textlen || h.textlen < 0 ||
+           h.to < 0 || h.to >= shards || h.from < 0 || h.from >= shards ||
+           the_server->GetShard(h.to)->IsRemote())
+        {
+            the_log.Log(SUELogger::log_warning, 
+                        "[chat] Garbage from worker %d", peer);
+            Shutdown();
+            return;
+        }
+        if(inputbuffer.Length() < h.length)
+            break;
+        ChatShard *to = the_server->GetShard(h.to);
+        ShardMessage *msg = new ShardMessage((ShardMessage::Kind)h.kind, 
+                                   to, the_server->GetShard(h.from));
+        const char *text = inputbuffer.GetBuffer() + sizeof(h);
+        msg->serial = h.serial;
+        msg->peer = h.peer;
+        memcpy(msg->name, h.name, sizeof(msg->name));
+        msg->name[max_name_length] = 0;
+        msg->text = ScriptVariable(h.textlen, "%.*s", h.textlen, text);
+        int payloadlen = h.length - sizeof(h) - h.textlen;
+        if(payloadlen > 0) 
+            msg->payload = new SUEPayload(text + h.textlen, payloadlen);
+        msg->gameid = h.gameid;
+        msg->hops = h.hops;
+        msg->ok = h.ok;
+        msg->has_state = h.has_state;
+        msg->state = h.state;
+        msg->count = h.count;
+        msg->games = h.games;
+        msg->query = (ListQuery*)h.query;
+        inputbuffer.DropData(h.length);
+        to->Post(msg);
+    }
+}
+
+void ShardLink::ShutdownHook()
+{
+    up = false;
+    the_log.Log(SUELogger::log_warning, 
+                "[chat] Lost the link to worker %d", peer);
+    if(the_server)
+        the_server->ShardDown(peer);
+}
+
+
+
+RemotePlayer::RemotePlayer(ChatShard *a_host, const ShardMessage *join)
+{
+    host = a_host;
+    home = join->from;
+    serial = join->serial;
+    strcpy(name, join->name);
+    session = 0;
+    next = 0;
+}
+
+void RemotePlayer::Print(const char *msg)
+{
+    ShardMessage *out = new ShardMessage(ShardMessage::game_output, 
+                                         home, host);
+    out->serial = serial;
+    out->text = msg;
+      // session is not known yet while it is being constructed
+    if(session) {
+        out->has_state = true;
+        out->state.Fetch(session);
+    }
+    home->Post(out);
+}
+
+void RemotePlayer::Broadcast(const char *msg)
+{
+    host->Broadcast(msg);
+}
+
+
+
+RemoteGame::RemoteGame(ChatServerSession *a_client, ChatShard *a_home,
+                       const ShardMessage *reply)
+    : AbstractGameSession(a_client)
+{
+    home = a_home;
+    host = reply->from;
+    serial = reply->serial;
+    state = reply->state;
+    left = false;
+}
+
+RemoteGame::~RemoteGame()
+{
+    if(left)
+        return;
+    ShardMessage *msg = new ShardMessage(ShardMessage::game_detach, 
+                                         host, home);
+    msg->serial = serial;
+    host->Post(msg);
+}
+
+void RemoteGame::HandleCommand(const char *cmd)
+{
+    ShardMessage *msg = new ShardMessage(ShardMessage::game_command, 
+                                         host, home);
+    msg->serial = serial;
+    msg->gameid = state.gameid;
+    msg->text = cmd;
+    host->Post(msg);
+}
+
+
+
+  // .who being collected from all the threads
+struct ListQuery {
+    unsigned long serial;
+    int pending;
+    bool *waiting;  // for the reply of each shard
+    int count;
+    int games;
+    ScriptVariable text;
+    ListQuery *prev, *next;
+};
+
+  // keeps a game's task going, a slice per run
+class GameTaskSlot : public SUETaskHandler {
+    ChatShard *the_shard;
+    SUEEventSelector *the_selector;
+public:
+    GameTask *task;
+    GameTaskSlot *next;
+
+    GameTaskSlot(ChatShard *sh, SUEEventSelector *sel, GameTask *t)
+        : the_shard(sh), the_selector(sel), task(t), next(0) {}
+    void Post() { the_selector->PostTask(this, SUEEventSelector::task_low); }
+    void Cancel() { the_selector->RemoveTask(this); }
+private:
+    virtual void TaskHandle() {
+        if(task->Step())
+            Post();
+        else
+            the_shard->TaskDone(this);
+    }
+};
+
+ChatShard::ChatShard(SUEEventSelector *a_selector, int *game_sequence)
+    : collection(game_sequence)
+{
+    the_server = 0;
+    index = 0;
+    the_selector = a_selector;
+    the_thread = 0;
+    link = 0;
+    InitSessions();
+    tasks = 0;
+    remote_players = 0;
+    queries = 0;
+    collection.SetTaskRunner(this);
+}
+
+ChatShard::ChatShard(SUEReactorThread *a_thread, int *game_sequence)
+    : collection(game_sequence)
+{
+    the_server = 0;
+    index = 0;
+    the_selector = a_thread->GetSelector();
+    the_thread = a_thread;
+    link = 0;
+    InitSessions();
+    tasks = 0;
+    remote_players = 0;
+    queries = 0;
+    collection.SetTaskRunner(this);
+}
+
+ChatShard::ChatShard(ShardLink *a_link)
+{
+    the_server = 0;
+    index = 0;
+    the_selector = 0;
+    the_thread = 0;
+    link = a_link;
+    InitSessions();
+    tasks = 0;
+    remote_players = 0;
+    queries = 0;
+}
+
+ChatShard::~ChatShard()
 {
     while(first) {
         Item* tmp = first;
         first = first->next;
         delete tmp;
     }
+    delete[] byserial;
+    delete[] chatters;
+    while(remote_players) 
+        DropRemotePlayer(remote_players);
+    while(queries) {
+        ListQuery *tmp = queries;
+        queries = tmp->next;
+        delete[] tmp->waiting;
+        delete tmp;
+    }
+      // the games are deleted after this, they'll find nothing to stop
+    while(tasks) {
+        GameTaskSlot *tmp = tasks;
+        tasks = tasks->next;
+        tmp->Cancel();
+        delete tmp;
+    }
+    if(link) {
+          // the server is gone already
+        link->Attach(0);
+        delete link;
+    }
 }
 
-SUETcpServerSession* ChatServer::SpawnSession(int newsessionfd)
+void ChatShard::StartTask(GameTask *task)
+{
+    GameTaskSlot *slot = new GameTaskSlot(this, the_selector, task);
+    slot->next = tasks;
+    tasks = slot;
+    slot->Post();
+}
+
+void ChatShard::StopTask(GameTask *task)
+{
+    for(GameTaskSlot **p = &tasks; *p; p = &((*p)->next)) {
+        if((*p)->task == task) {
+            GameTaskSlot *tmp = *p;
+            *p = tmp->next;
+            tmp->Cancel();
+            delete tmp;
+            return;
+        }
+    }
+}
+
+void ChatShard::TaskDone(GameTaskSlot *slot)
+{
+    for(GameTaskSlot **p = &tasks; *p; p = &((*p)->next)) {
+        if(*p == slot) {
+            *p = slot->next;
+            delete slot;
+            return;
+        }
+    }
+}
+
+void ChatShard::Attach(ChatServer *a_server, int a_index)
+{
+    the_server = a_server;
+    index = a_index;
+    if(link)
+        link->Attach(a_server);
+}
+
+ChatShard *ChatShard::Next() const
+{
+    int n = the_server->ShardCount();
+    for(int i = 1; i < n; i++) {
+        ChatShard *s = the_server->GetShard((index + i) % n);
+        if(!s->IsDown())
+            return s;
+    }
+    return the_server->GetShard(index);
+}
+
+void ChatShard::Post(ShardMessage *msg)
+{
+    if(the_thread) {
+        the_thread->Post(msg);
+    } else 
+    if(link) {
+        if(link->IsUp())
+            link->Send(msg);
+        else
+            Bounce(msg);
+        delete msg;
+    } else {
+          // the only shard, served by the main thread
+        msg->Deliver();
+        delete msg;
+    }
+}
+
+void ChatShard::InitSessions()
+{
+    first = 0;
+    byserialsize = 64;
+    byserial = new Item*[byserialsize];
+    for(int i = 0; i < byserialsize; i++)
+        byserial[i] = 0;
+    sessioncount = 0;
+    chattersize = 64;
+    chatters = new ChatServerSession*[chattersize];
+    chattercount = 0;
+}
+
+void ChatShard::IndexItem(Item *item)
+{
+    Item **b = &byserial[item->sess->GetSerial() & (byserialsize - 1)];
+    item->nextbyserial = *b;
+    *b = item;
+}
+
+ChatServerSession *ChatShard::NewSession(int fd, int timeout)
 {
     Item *tmp = new Item;
+    tmp->sess = 
+        new ChatServerSession(fd, timeout, the_selector, the_server, this);
+    tmp->prev = 0;
     tmp->next = first;
-    tmp->sess = new ChatServerSession(newsessionfd, timeout, selector, this);
+    if(first)
+        first->prev = tmp;
     first = tmp;
-    return first->sess;
+    sessioncount++;
+    if(sessioncount > byserialsize) {
+        delete[] byserial;
+        byserialsize *= 2;
+        byserial = new Item*[byserialsize];
+        for(int i = 0; i < byserialsize; i++)
+            byserial[i] = 0;
+        for(Item *it = first; it; it = it->next)
+            IndexItem(it);
+    } else {
+        IndexItem(tmp);
+    }
+    return tmp->sess;
 }
 
-void ChatServer::SendMessage(const char *name, const char *message)
+void ChatShard::ExcludeSession(ChatServerSession *sess)
+{
+    if(sess->GetName())
+        the_server->ReleaseName(sess->GetName());
+    SetChatSubscriber(sess, false);
+    Item **b = &byserial[sess->GetSerial() & (byserialsize - 1)];
+    while(*b && (*b)->sess != sess) b = &((*b)->nextbyserial);
+    if(!*b) return;
+    Item *to_del = *b;
+    *b = to_del->nextbyserial;
+    if(to_del->prev)
+        to_del->prev->next = to_del->next;
+    else
+        first = to_del->next;
+    if(to_del->next)
+        to_del->next->prev = to_del->prev;
+    sessioncount--;
+    delete to_del;
+}
+
+  // the array is kept contiguous: the last one takes the place of the
+  // one who leaves
+void ChatShard::SetChatSubscriber(ChatServerSession *sess, bool on)
+{
+    int slot = sess->GetChatSlot();
+    if(on == (slot != -1))
+        return;
+    if(on) {
+        if(chattercount == chattersize) {
+            ChatServerSession **tmp = new ChatServerSession*[chattersize*2];
+            memcpy(tmp, chatters, chattercount * sizeof(*chatters));
+            delete[] chatters;
+            chatters = tmp;
+            chattersize *= 2;
+        }
+        chatters[chattercount] = sess;
+        sess->SetChatSlot(chattercount);
+        chattercount++;
+    } else {
+        chattercount--;
+        chatters[slot] = chatters[chattercount];
+        chatters[slot]->SetChatSlot(slot);
+        sess->SetChatSlot(-1);
+    }
+}
+
+ChatServerSession* ChatShard::FindBySerial(unsigned long serial) const
+{
+    Item *tmp = byserial[serial & (byserialsize - 1)];
+    while(tmp && tmp->sess->GetSerial() != serial) 
+        tmp = tmp->nextbyserial;
+    return tmp ? tmp->sess : 0;
+}
+
+void ChatShard::SendMessage(const char *name, const char *message)
 {
     char buf[1024];
     snprintf(buf, sizeof(buf), "<%s> %s\n", name, message);
-    Send(buf);
+    the_server->Send(this, buf);
 }
 
-void ChatServer::SendEvent(const char *name, const char *event)
+void ChatShard::SendEvent(const char *name, const char *event)
 {
     char buf[1024];
     snprintf(buf, sizeof(buf), "* %s %s\n", name, event);
-    Send(buf);
+    the_server->Send(this, buf);
 }
 
-void ChatServer::ExcludeSession(ChatServerSession *sess)
+void ChatShard::Broadcast(const char *msg)
 {
-    Item **tmp = &first;
-    while(*tmp && (*tmp)->sess != sess) tmp = &((*tmp)->next);
-    if(!*tmp) return;
-    Item *to_del = *tmp;
-    *tmp = (*tmp)->next;
-    delete to_del;
+    the_server->Send(this, msg, true);
 }
 
-void ChatServer::Send(const char *msg, bool urgent)
+void ChatShard::Chat(SUEPayload *msg, bool urgent)
 {
-    fprintf(stderr, "[chat] %s", msg);
-    fflush(stdout);
-    for(Item *tmp = first; tmp; tmp=tmp->next)
-        if(urgent)
+    if(urgent) {
+        for(Item *tmp = first; tmp; tmp=tmp->next)
             tmp->sess->Send(msg);
-        else 
-            tmp->sess->ChatSend(msg);
-}
-
-bool ChatServer::IsNameAvailable(const char *name) const
-{
-    return !FindByName(name);
+    } else {
+        for(int i = 0; i < chattercount; i++)
+            chatters[i]->ChatSend(msg);
+    }
 }
 
-ChatServerSession* ChatServer::FindByName(const char *name) const
+void ChatShard::Tell(ChatShard *where, unsigned long to, const char *msg)
 {
-    for(Item *tmp = first; tmp; tmp=tmp->next) {
-        const char *p = tmp->sess->GetName();
-        if(p && strcmp(p, name)==0) return tmp->sess;
+    if(where == this) {
+        ChatServerSession *sess = FindBySerial(to);
+        if(sess) 
+            sess->Send(msg);
+        return;
     }
-    return 0;
+    ShardMessage *tell = new ShardMessage(ShardMessage::tell, where, this);
+    tell->peer = to;
+    tell->text = msg;
+    where->Post(tell);
 }
 
-void ChatServer::SendMeList(ChatServerSession *back) const
+void ChatShard::ListSessions(ScriptVariable &out, int &count) const
 {
-    int count = 0;
+    count = 0;
     for(Item *tmp = first; tmp; tmp=tmp->next) {
         ScriptVariable sv("% "); 
         const char *name = tmp->sess->GetName();
@@ -458,12 +1528,395 @@ void ChatServer::SendMeList(ChatServerSession *back) const
         while(sv.Length()<max_name_length+10) sv += " ";
         sv += tmp->sess->GetStatus();
         sv += "\n";
-        back->Send(sv.c_str());
+        out += sv;
         count++;
     }
-    ScriptVariable sv(80, "%% %d players online. %d games are played\n",
-                          count, the_collection->GameCount());
-    back->Send(sv.c_str());
+}
+
+void ChatShard::RequestList(ChatServerSession *sess)
+{
+    int n = the_server->ShardCount();
+    ListQuery *q = new ListQuery;
+    q->serial = sess->GetSerial();
+    q->waiting = new bool[n];
+    q->pending = 1;  // our own part
+    for(int i = 0; i < n; i++) {
+        ChatShard *s = the_server->GetShard(i);
+        q->waiting[i] = s != this && !s->IsDown();
+        if(q->waiting[i])
+            q->pending++;
+    }
+    q->count = 0;
+    q->games = 0;
+    q->prev = 0;
+    q->next = queries;
+    if(queries)
+        queries->prev = q;
+    queries = q;
+    for(int i = 0; i < n; i++) {
+        if(!q->waiting[i])
+            continue;
+        ChatShard *s = the_server->GetShard(i);
+        ShardMessage *req = 
+            new ShardMessage(ShardMessage::list_request, s, this);
+        req->query = q;
+        s->Post(req);
+    }
+    ScriptVariable text("");
+    int count;
+    ListSessions(text, count);
+    CollectList(q, this, text.c_str(), count, collection.GameCount());
+}
+
+void ChatShard::CollectList(ListQuery *q, ChatShard *from, 
+                            const char *text, int count, int games)
+{
+    if(from != this) {
+        if(!q->waiting[from->Index()])
+            return;
+        q->waiting[from->Index()] = false;
+    }
+    q->text += text;
+    q->count += count;
+    q->games += games;
+    if(--q->pending > 0)
+        return;
+    ChatServerSession *back = FindBySerial(q->serial);
+    if(back) {
+        back->Send(q->text.c_str());
+        ScriptVariable sv(80, "%% %d players online. %d games are played\n",
+                              q->count, q->games);
+        back->Send(sv.c_str());
+    }
+    if(q->prev)
+        q->prev->next = q->next;
+    else
+        queries = q->next;
+    if(q->next)
+        q->next->prev = q->prev;
+    delete[] q->waiting;
+    delete q;
+}
+
+  // a request to the shard which is down: answer it with a failure, so
+  // nobody waits for the answer forever
+void ChatShard::Bounce(const ShardMessage *msg)
+{
+    ShardMessage *reply;
+    switch(msg->kind) {
+    case ShardMessage::join_request:
+        reply = new ShardMessage(ShardMessage::join_reply, msg->from, this);
+        reply->text = "%- Couldn't join the game\n";
+        break;
+    case ShardMessage::game_command:
+        reply = new ShardMessage(ShardMessage::game_left, msg->from, this);
+        reply->gameid = msg->gameid;
+        break;
+    default:
+          // .who never asks the shard which is down, and nobody waits
+          // for the rest
+        return;
+    }
+    reply->serial = msg->serial;
+    msg->from->Post(reply);
+}
+
+void ChatShard::ShardDown(ChatShard *dead)
+{
+    ListQuery *q = queries;
+    while(q) {
+        ListQuery *next = q->next;  // q may be deleted
+        CollectList(q, dead, "", 0, 0);
+        q = next;
+    }
+    for(Item *tmp = first; tmp; tmp = tmp->next)
+        tmp->sess->ShardDown(dead);
+    RemotePlayer *rp = remote_players;
+    while(rp) {
+        RemotePlayer *next = rp->next;
+        if(rp->home == dead)
+            DropRemotePlayer(rp);
+        rp = next;
+    }
+    collection.RemoveZombies();
+}
+
+  /* .join goes round the threads until the one having the game is found.
+     If the game is identified by a nick, the round starts from the 
+     thread of the nick's owner, which finds out the game's number.
+   */
+void ChatShard::RequestJoin(ChatServerSession *sess, int gameid,
+                            ChatShard *where, unsigned long nickowner)
+{
+    ShardMessage *msg = 
+        new ShardMessage(ShardMessage::join_request, where, this);
+    msg->serial = sess->GetSerial();
+    msg->peer = nickowner;
+    strcpy(msg->name, sess->GetName());
+    msg->gameid = gameid;
+      // we've checked our own games already unless the nick is given
+    msg->hops = the_server->ShardCount() - (gameid ? 1 : 0);
+    where->Post(msg);
+}
+
+void ChatShard::ServeJoin(ShardMessage *msg)
+{
+    const char *failure = "%- Couldn't join the game\n";
+    if(!msg->gameid) {
+        ChatServerSession *nickowner = FindBySerial(msg->peer);
+        if(!nickowner) 
+            failure = "%- No such nick\n";
+        else
+        if(!nickowner->GameId())
+            failure = "%- That one is not playing now\n";
+        else 
+            msg->gameid = nickowner->GameId();
+    }
+    if(msg->gameid && msg->from == this) {
+          // the round came back home
+        ChatServerSession *sess = FindBySerial(msg->serial);
+        if(sess && sess->IsJoining()) 
+            sess->JoinLocalGame(msg->gameid);
+        return;
+    }
+    if(msg->gameid && !HasGame(msg->gameid) && --msg->hops > 0) {
+        ChatShard *next = Next();
+        ShardMessage *fwd = 
+            new ShardMessage(ShardMessage::join_request, next, msg->from);
+        fwd->serial = msg->serial;
+        strcpy(fwd->name, msg->name);
+        fwd->gameid = msg->gameid;
+        fwd->hops = msg->hops;
+        next->Post(fwd);
+        return;
+    }
+    ShardMessage *reply = 
+        new ShardMessage(ShardMessage::join_reply, msg->from, this);
+    reply->serial = msg->serial;
+    if(msg->gameid && HasGame(msg->gameid)) {
+        RemotePlayer *rp = new RemotePlayer(this, msg);
+        rp->session = collection.Join(rp, msg->gameid);
+        if(rp->session) {
+            rp->next = remote_players;
+            remote_players = rp;
+            reply->ok = true;
+            reply->has_state = true;
+            reply->state.Fetch(rp->session);
+        } else {
+            delete rp;
+        }
+    }
+    if(!reply->ok)
+        reply->text = msg->gameid ? "%- Couldn't join the game\n" : failure;
+    msg->from->Post(reply);
+}
+
+void ChatShard::ServeGameCommand(const ShardMessage *msg)
+{
+    RemotePlayer *rp = FindRemotePlayer(msg->serial);
+    if(!rp) 
+        return;  // must have left the game already
+    rp->session->HandleCommand(msg->text.c_str());
+    if(rp->session->ZombieState()) {
+        ShardMessage *left = 
+            new ShardMessage(ShardMessage::game_left, rp->home, this);
+        left->serial = rp->serial;
+        left->gameid = rp->session->GameId();
+        DropRemotePlayer(rp);
+        msg->from->Post(left);
+        collection.RemoveZombies();
+    }
+}
+
+RemotePlayer *ChatShard::FindRemotePlayer(unsigned long serial) const
+{
+    for(RemotePlayer *tmp = remote_players; tmp; tmp = tmp->next)
+        if(tmp->serial == serial)
+            return tmp;
+    return 0;
+}
+
+void ChatShard::DropRemotePlayer(RemotePlayer *rp)
+{
+    RemotePlayer **tmp = &remote_players;
+    while(*tmp && *tmp != rp) tmp = &((*tmp)->next);
+    if(*tmp) 
+        *tmp = rp->next;
+    delete rp;
+}
+
+void ChatShard::Receive(ShardMessage *msg)
+{
+    switch(msg->kind) {
+    case ShardMessage::chat:
+    case ShardMessage::chat_urgent:
+        Chat(msg->payload, msg->kind == ShardMessage::chat_urgent);
+        break;
+    case ShardMessage::tell:
+        Tell(this, msg->peer, msg->text.c_str());
+        break;
+    case ShardMessage::list_request: {
+        ShardMessage *reply = 
+            new ShardMessage(ShardMessage::list_reply, msg->from, this);
+        reply->query = msg->query;
+        ListSessions(reply->text, reply->count);
+        reply->games = collection.GameCount();
+        msg->from->Post(reply);
+        break;
+    }
+    case ShardMessage::list_reply:
+        CollectList(msg->query, msg->from, 
+                    msg->text.c_str(), msg->count, msg->games);
+        break;
+    case ShardMessage::join_request:
+        ServeJoin(msg);
+        break;
+    case ShardMessage::join_reply: {
+        ChatServerSession *sess = FindBySerial(msg->serial);
+        if(sess && sess->IsJoining()) {
+            sess->RemoteJoinDone(msg);
+        } else 
+        if(msg->ok) {
+              // too late, the player is gone or has given up
+            ShardMessage *detach = 
+                new ShardMessage(ShardMessage::game_detach, msg->from, this);
+            detach->serial = msg->serial;
+            msg->from->Post(detach);
+        }
+        break;
+    }
+    case ShardMessage::game_command:
+        ServeGameCommand(msg);
+        break;
+    case ShardMessage::game_output: {
+        ChatServerSession *sess = FindBySerial(msg->serial);
+        if(sess)
+            sess->RemoteGameOutput(msg);
+        break;
+    }
+    case ShardMessage::game_left: {
+        ChatServerSession *sess = FindBySerial(msg->serial);
+        if(sess)
+            sess->RemoteGameLeft(msg->gameid);
+        break;
+    }
+    case ShardMessage::game_detach: {
+        RemotePlayer *rp = FindRemotePlayer(msg->serial);
+        if(rp) {
+            DropRemotePlayer(rp);
+            collection.RemoveZombies();
+        }
+        break;
+    }
+    }
+}
+
+
+
+
+
+ChatServer::ChatServer(int a_port, int a_timeout, Lobby *a_lobby)
+    : SUETcpServer("0.0.0.0", a_port)
+{
+    shards = 0;
+    shardcount = 0;
+    timeout = a_timeout;
+    lobby = a_lobby;
+}
+
+ChatServer::~ChatServer()
+{
+    if(shards)
+        delete[] shards;
+}
+
+void ChatServer::AddShard(ChatShard *shard)
+{
+    ChatShard **tmp = new ChatShard*[shardcount+1];
+    for(int i = 0; i < shardcount; i++)
+        tmp[i] = shards[i];
+    tmp[shardcount] = shard;
+    if(shards)
+        delete[] shards;
+    shards = tmp;
+    shard->Attach(this, shardcount);
+    shardcount++;
+    if(shard->GetThread())
+        AddReactor(shard->GetThread());
+}
+
+SUETcpServerSession* ChatServer::SpawnSession(int newsessionfd)
+{
+    int i = 0;
+    while(shards[i]->IsRemote())
+        i++;
+    return shards[i]->NewSession(newsessionfd, timeout);
+}
+
+SUETcpServerSession* ChatServer::SpawnReactorSession(int newsessionfd,
+                                             SUEEventSelector *a_selector)
+{
+    for(int i = 0; i < shardcount; i++)
+        if(shards[i]->GetSelector() == a_selector)
+            return shards[i]->NewSession(newsessionfd, timeout);
+    return SUETcpServer::SpawnReactorSession(newsessionfd, a_selector);
+}
+
+void ChatServer::Send(ChatShard *from, const char *msg, bool urgent)
+{
+    the_log.Log(SUELogger::log_info, "[chat] %s", msg);
+      // a single copy of the message for all the sessions of all 
+      // the threads
+    SUEPayload *payload = new SUEPayload(msg);
+    for(int i = 0; i < shardcount; i++) {
+        if(shards[i] == from) continue;
+        ShardMessage *m = new ShardMessage(urgent ? 
+                                           ShardMessage::chat_urgent :
+                                           ShardMessage::chat, 
+                                           shards[i], from);
+        payload->AddRef();
+        m->payload = payload;
+        shards[i]->Post(m);
+    }
+    from->Chat(payload, urgent);
+    payload->Release();
+}
+
+void ChatServer::ShardDown(int idx)
+{
+    for(int i = 0; i < shardcount; i++)
+        if(!shards[i]->IsRemote())
+            shards[i]->ShardDown(shards[idx]);
+}
+
+bool ChatServer::ClaimName(const char *name, ChatShard *shard, 
+                           unsigned long serial)
+{
+    lobby->Lock();
+    bool ok = lobby->Find(name) == -1 && 
+              lobby->Add(name, shard->Index(), serial);
+    lobby->Unlock();
+    return ok;
+}
+
+void ChatServer::ReleaseName(const char *name)
+{
+    lobby->Lock();
+    lobby->Remove(name);
+    lobby->Unlock();
+}
+
+bool ChatServer::FindByName(const char *name, 
+                            ChatShard *&shard, unsigned long &serial)
+{
+    lobby->Lock();
+    int i = lobby->Find(name);
+    if(i != -1) {
+        shard = shards[lobby->names[i].shard];
+        serial = lobby->names[i].serial;
+    }
+    lobby->Unlock();
+    return i != -1;
 }
 
 
@@ -478,38 +1931,250 @@ public:
 
 
 
-int main(int argc, char **argv)
+  // the worker process serving the shard has exited
+class WorkerWatcher : public SUEChildHandler {
+    int worker;
+    Lobby *lobby;
+    int *alive;
+    SUEEventSelector *selector;
+public:
+    WorkerWatcher(pid_t pid, SUEChildWaitAgent *agent, int a_worker,
+                  Lobby *a_lobby, int *a_alive, SUEEventSelector *a_sel)
+        : SUEChildHandler(pid, agent), worker(a_worker), lobby(a_lobby),
+          alive(a_alive), selector(a_sel) {}
+    virtual void ChildHandle() {
+        the_log.Log(SUELogger::log_warning, 
+                    "[chat] Worker %d exited", worker);
+          // its users are gone, let others take the names
+        lobby->ReleaseShard(worker);
+        if(--*alive == 0)
+            selector->Break();
+    }
+};
+
+
+  // the log is written by a thread, so it is started after forking
+static void start_log(int worker)
 {
-    try {
-        if(argc>1) {
-            the_server_port = atoi(argv[1]);
-            if(!the_server_port) {
-                fprintf(stderr, "Invalid port number\n");
-                exit(1);
-            }
+    ScriptVariable name("");
+    if(the_log_file) {
+        name = the_log_file;
+        if(worker != -1)
+            name += ScriptVariable(16, ".w%d", worker);
+    }
+    the_log.SetLevel(the_log_level);
+    if(!the_log.Start(the_log_file ? name.c_str() : 0, 
+                      the_log_max_size, the_log_keep)) 
+    {
+        fprintf(stderr, "Couldn't start the log\n");
+        exit(1);
+    }
+}
+
+  /* Serve the port.  In a worker process (worker is not -1), the 
+     shards of the other workers are reached through the links given,
+     links[i] being the descriptor to talk to the worker i with.
+   */
+static void serve(Lobby *lobby, int worker, const int *links)
+{
+    start_log(worker);
+    SUEEventSelector selector(the_backend);
+      // the threads (if any) must outlive the server and its sessions
+    int nshards = the_reactor_threads > 0 ? the_reactor_threads : 1;
+    if(worker != -1)
+        nshards = the_worker_processes;
+    SUEReactorThread **reactors = new SUEReactorThread*[nshards];
+    ChatShard **shards = new ChatShard*[nshards];
+    for(int i = 0; i < nshards; i++) {
+        reactors[i] = 0;
+        if(worker != -1 && i != worker) {
+            shards[i] = new ChatShard(new ShardLink(links[i], i, &selector));
+        } else
+        if(the_reactor_threads > 0) {
+            reactors[i] = new SUEReactorThread(the_backend);
+            shards[i] = new ChatShard(reactors[i], &lobby->game_sequence);
+        } else {
+            shards[i] = new ChatShard(&selector, &lobby->game_sequence);
         }
-        SUEEventSelector selector;
-        GameCollection collection;
-        ChatServer serv(the_server_port, the_server_timeout, &collection);
+    }
+    {
+        ChatServer serv(the_server_port, the_server_timeout, lobby);
+        for(int i = 0; i < nshards; i++)
+            serv.AddShard(shards[i]);
+        serv.SetBacklog(the_listen_backlog);
+        serv.SetReusePort(worker != -1);
         if(serv.Up(&selector)) { 
-            fprintf(stderr, "[chat] Listening port %d\n", the_server_port);
+            if(worker != -1)
+                the_log.Log(SUELogger::log_info, 
+                            "[chat] Worker %d listening port %d", 
+                            worker, the_server_port);
+            else
+                the_log.Log(SUELogger::log_info, 
+                            "[chat] Listening port %d", the_server_port);
         } else {
-            fprintf(stderr, "Failed to bring the server up, exiting...\n");
+            fprintf(stderr, "Failed to bring the server up, "
+                            "exiting...\n");
             exit(1);
         }
 
         SigtermHandler term(&selector);
         selector.RegisterSignalHandler(&term);
+        for(int i = 0; i < nshards; i++) {
+            if(reactors[i] && !reactors[i]->Start()) {
+                fprintf(stderr, "Failed to start a thread, "
+                                "exiting...\n");
+                exit(1);
+            }
+        }
+        if(the_reactor_threads > 0)
+            the_log.Log(SUELogger::log_info, 
+                        "[chat] Serving with %d threads", 
+                        the_reactor_threads);
+        if(selector.GetUring())
+            the_log.Log(SUELogger::log_info, "[chat] Using io_uring");
         for(;;) {
             try {
                 selector.Go();
-                fprintf(stderr, "Main loop broken... why?\n");
+                the_log.Log(SUELogger::log_error, 
+                            "Main loop broken... why?");
                 break;
             }
             catch(const char *str) {
-                fprintf(stderr, "Exception: %s\n", str);
+                the_log.Log(SUELogger::log_error, "Exception: %s", str);
+            }
+        }
+        for(int i = 0; i < nshards; i++)
+            if(reactors[i]) 
+                reactors[i]->Stop();
+    }
+    for(int i = 0; i < nshards; i++) {
+        delete shards[i];
+        if(reactors[i])
+            delete reactors[i];
+    }
+    delete[] shards;
+    delete[] reactors;
+}
+
+  /* Fork the workers, each having a shard of its own and listening the
+     same port (the kernel spreads the connections among them), and
+     connect every two of them with a Unix domain socket to pass the 
+     messages between the shards.  The names, the serials and the game
+     numbers are kept in the lobby, which is in the shared memory.  
+     Then just wait for SIGINT to pass it to the workers.
+   */
+static void serve_with_workers(Lobby *lobby)
+{
+    int n = the_worker_processes;
+      // links[i][j] is what worker i talks to worker j through
+    int **links = new int*[n];
+    for(int i = 0; i < n; i++) {
+        links[i] = new int[n];
+        links[i][i] = -1;
+    }
+    for(int i = 0; i < n; i++) {
+        for(int j = i+1; j < n; j++) {
+            int sv[2];
+            if(-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 
+                                0, sv))
+            {
+                throw "couldn't create the links between the workers";
+            }
+            links[i][j] = sv[0];
+            links[j][i] = sv[1];
+        }
+    }
+    pid_t *pids = new pid_t[n];
+    for(int w = 0; w < n; w++) {
+        pids[w] = fork();
+        if(pids[w] == -1) 
+            throw "couldn't fork a worker";
+        if(pids[w] == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGINT);  // don't outlive us
+            for(int i = 0; i < n; i++)
+                for(int j = 0; j < n; j++)
+                    if(i != w && links[i][j] != -1)
+                        close(links[i][j]);
+            serve(lobby, w, links[w]);
+            exit(0);
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        for(int j = 0; j < n; j++)
+            if(links[i][j] != -1)
+                close(links[i][j]);
+        delete[] links[i];
+    }
+    delete[] links;
+
+    start_log(-1);
+    SUEEventSelector selector;
+    SUEChildWaitAgent agent;
+    agent.Register(&selector);
+    int alive = n;
+    for(int w = 0; w < n; w++)
+        new WorkerWatcher(pids[w], &agent, w, lobby, &alive, &selector);
+    SigtermHandler term(&selector);
+    selector.RegisterSignalHandler(&term);
+    the_log.Log(SUELogger::log_info, 
+                "[chat] Serving with %d worker processes", n);
+    selector.Go();
+    for(int w = 0; w < n; w++)
+        kill(pids[w], SIGINT);
+    while(wait(0) > 0)
+        ;
+    delete[] pids;
+}
+
+
+int main(int argc, char **argv)
+{
+    try {
+        if(argc>1) {
+            the_server_port = atoi(argv[1]);
+            if(!the_server_port) {
+                fprintf(stderr, "Invalid port number\n");
+                exit(1);
+            }
+        }
+        if(argc>2) {
+            the_reactor_threads = atoi(argv[2]);
+            if(the_reactor_threads < 0) {
+                fprintf(stderr, "Invalid number of threads\n");
+                exit(1);
+            }
+        }
+        if(argc>3) {
+            if(0 == strcmp(argv[3], "select")) {
+                the_backend = SUEEventSelector::backend_select;
+            } else if(0 == strcmp(argv[3], "epoll")) {
+                the_backend = SUEEventSelector::backend_epoll;
+            } else if(0 == strcmp(argv[3], "uring")) {
+                the_backend = SUEEventSelector::backend_uring;
+            } else {
+                fprintf(stderr, "Unknown backend (select, epoll or uring "
+                                "expected)\n");
+                exit(1);
+            }
+        }
+        if(argc>4) {
+            the_worker_processes = atoi(argv[4]);
+            if(the_worker_processes < 0) {
+                fprintf(stderr, "Invalid number of processes\n");
+                exit(1);
+            }
+            if(the_worker_processes > 1 && the_reactor_threads > 0) {
+                fprintf(stderr, "Worker processes can't have threads\n");
+                exit(1);
             }
         }
+        if(argc>5)
+            the_log_file = argv[5];
+        Lobby *lobby = Lobby::Create();
+        if(the_worker_processes > 1)
+            serve_with_workers(lobby);
+        else
+            serve(lobby, -1, 0);
     }
     catch(const char *str) {
         fprintf(stderr, "Fatal: %s\n", str);
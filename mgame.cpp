@@ -16,7 +16,6 @@
 
 #include <stdlib.h>
 
-#include "scriptpp/scrvect.hpp"
 #include "stock.hpp"
 #include "mgame.hpp"
 
@@ -86,12 +85,16 @@ ManagerGame::ManagerGame(int seqn)
       status_message(20, "waiting #%d", seqn) 
 { 
     state = gs_notstarted; 
+    endturn = et_none;
     market = new Market;
     first = 0;
+    endturn_next = 0;
 }
 
 ManagerGame::~ManagerGame()
 {
+    if(endturn != et_none)
+        StopTask(this);
     delete market;
     while(first) {
         /* in fact this should never happen, but let it be... */
@@ -118,6 +121,9 @@ void ManagerGame::Start()
 {
     state = gs_playing;
     status_message = ScriptVariable(20, "playing #%d", GetSeqnum());
+      // the players don't get the global chat anymore, unless asked to
+    for(Item *tmp = first; tmp; tmp = tmp->next)
+        tmp->sess->NotifyChatState();
     Broadcast("& START\n");
 }
 
@@ -156,6 +162,8 @@ void ManagerGame::RemoveSession(ManagerGameSession *sess)
 
             Item *tmp = *cur;
             *cur = (*cur)->next;
+            if(tmp == endturn_next)
+                endturn_next = tmp->next;
             delete tmp;
         } else {
             cur = &((*cur)->next);
@@ -192,6 +200,8 @@ int ManagerGame::GetAlivePlayers() const
 
 void ManagerGame::CheckEndTurn()
 {
+    if(endturn != et_none)
+        return;  // the turn is being finished right now
     bool ok = true;
     ScriptVariable still_thinking("# Still thinking: ");
     for(Item *iter = first; iter; iter = iter->next) {
@@ -210,7 +220,52 @@ void ManagerGame::CheckEndTurn()
     }
 }
 
+#ifndef ENDTURN_PLAYERS_PER_STEP
+#define ENDTURN_PLAYERS_PER_STEP 8
+#endif
+
 void ManagerGame::DoEndTurn()
+{
+    endturn = et_trade;
+    StartTask(this);
+}
+
+bool ManagerGame::Step()
+{
+    if(state != gs_playing) {   // e.g., aborted meanwhile
+        endturn = et_none;
+        return false;
+    }
+    switch(endturn) {
+        case et_trade:
+            EndTurnTrade();
+            endturn_next = first;
+            endturn = et_players;
+            return true;
+        case et_players: {
+            int n = 0;
+            while(endturn_next && n < ENDTURN_PLAYERS_PER_STEP) {
+                ManagerGameSession *p = endturn_next->sess;
+                endturn_next = endturn_next->next;
+                if(p->IsSpectator()) continue;
+                p->TurnEnd();
+                n++;
+            }
+            if(!endturn_next)
+                endturn = et_results;
+            return true;
+        }
+        case et_results:
+            endturn = et_none;
+            EndTurnResults();
+            return false;
+        case et_none:
+            ;
+    }
+    return false;
+}
+
+void ManagerGame::EndTurnTrade()
 {
     Broadcast("# Trading results:\n");
     ScriptVariable msg(80, "# --------  %16s %10s %10s\n",
@@ -243,14 +298,10 @@ void ManagerGame::DoEndTurn()
     while(prod_stock.GetWinner(id, amount, price)) {
         ((ManagerGameSession*)id)->SellProd(amount, price);
     }
+}
 
-    // actually end turn
-    for(Item *iter = first; iter; iter = iter->next) {
-        ManagerGameSession *p = iter->sess;
-        if(p->IsSpectator()) continue;
-        p->TurnEnd();
-    }
-
+void ManagerGame::EndTurnResults()
+{
     // check if the game is over
     switch(GetAlivePlayers()) {
         case 0:
@@ -321,8 +372,9 @@ void ManagerGame::SendMeInfo(ManagerGameSession *sess)
 
 void ManagerGame::Broadcast(const char *msg) const 
 {
+    BroadcastText text(msg);
     for(Item *tmp = first; tmp; tmp=tmp->next) {
-        tmp->sess->SendMessage(msg);
+        tmp->sess->SendBroadcast(text);
     }
 }
 
@@ -374,31 +426,83 @@ ManagerGameSession::~ManagerGameSession()
 
 
 
-#define MUST_BE_PLAYED \
-        if(!the_game->IsStarted()) { \
-            SendMessage("&- The game hasn't been started yet...\n");\
-            return;\
-        }\
-        if(the_game->IsFinished()) { \
-            SendMessage("&- The game is over, type quit to quit...\n");\
-            return;\
-        }
+  // what a command needs, checked in this order
+enum {
+    cmdf_active = 0x01,  // the player is not a spectator
+    cmdf_played = 0x02,  // the game is started and not finished yet
+    cmdf_turn   = 0x04,  // the player hasn't finished the turn yet
+    cmdf_played_first = 0x08  // check cmdf_played before cmdf_active
+};
 
-#define MUST_BE_TURN \
-        if(is_turn_ended) { \
-            SendMessage("&- You have already finished your turn...\n");\
-            return;\
-        }
+enum {
+    gc_help, gc_start, gc_quit, gc_buy, gc_sell, gc_prod, gc_build,
+    gc_abuild, gc_upgrade, gc_turn, gc_market, gc_info, gc_requests,
+    gc_chat, gc_say
+};
+
+static const CommandVerb game_verbs[] = {
+    { "help",    gc_help,     0 },
+    { "start",   gc_start,    0 },
+    { "quit",    gc_quit,     0 },
+    { "buy",     gc_buy,      cmdf_active | cmdf_played | cmdf_turn },
+    { "sell",    gc_sell,     cmdf_active | cmdf_played | cmdf_turn },
+    { "prod",    gc_prod,     cmdf_active | cmdf_played | cmdf_turn },
+    { "build",   gc_build,    cmdf_active | cmdf_played | cmdf_turn },
+    { "abuild",  gc_abuild,   cmdf_active | cmdf_played | cmdf_turn },
+    { "upgrade", gc_upgrade,  cmdf_active | cmdf_played | cmdf_turn },
+    { "turn",    gc_turn,     cmdf_active | cmdf_played | cmdf_turn },
+    { "market",  gc_market,   cmdf_played },
+    { "info",    gc_info,     0 },
+    { "?",       gc_requests, cmdf_active|cmdf_played|cmdf_played_first },
+    { "chat",    gc_chat,     0 },
+    { "say",     gc_say,      0 }
+};
+
+static const CommandTable game_commands(game_verbs, 
+                                   sizeof(game_verbs)/sizeof(*game_verbs));
 
-#define MUST_BE_ACTIVE \
-        if(is_spectator) { \
-            SendMessage("&- You can only watch not play!\n");\
-            return;\
+bool ManagerGameSession::CommandAllowed(unsigned int flags)
+{
+    if((flags & cmdf_played_first) && !GameIsPlayed())
+        return false;
+    if((flags & cmdf_active) && is_spectator) {
+        SendMessage("&- You can only watch not play!\n");
+        return false;
+    }
+    if((flags & cmdf_played) && !(flags & cmdf_played_first) &&
+        !GameIsPlayed())
+    {
+        return false;
+    }
+    if(flags & cmdf_turn) {
+        if(is_turn_ended) {
+            SendMessage("&- You have already finished your turn...\n");
+            return false;
         }
+        if(the_game->IsTurnInProgress()) {
+            SendMessage("&- The turn is being finished, please wait...\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ManagerGameSession::GameIsPlayed()
+{
+    if(!the_game->IsStarted()) {
+        SendMessage("&- The game hasn't been started yet...\n");
+        return false;
+    }
+    if(the_game->IsFinished()) {
+        SendMessage("&- The game is over, type quit to quit...\n");
+        return false;
+    }
+    return true;
+}
 
 void ManagerGameSession::HandleCommand(const char *a_cmd) 
 {
-    ScriptVector cmd(a_cmd);
+    CommandLine cmd(a_cmd);
     if(cmd.Length()<1) {
         // empty line
 	SendMessage("# Your name is ");
@@ -412,8 +516,19 @@ void ManagerGameSession::HandleCommand(const char *a_cmd)
                 "# Type 'start' to start the game, you're the Creator!\n");
         if(is_spectator && !the_game->IsFinished())
             SendMessage("# * You can only watch not play *\n");
-    } else
-    if(cmd[0] == "help") {
+        SendPrompt();
+        return;
+    }
+    const CommandVerb *verb = game_commands.Find(cmd);
+    if(!verb) {
+        SendMessage("&- Unknown command\n");
+        SendPrompt();
+        return;
+    }
+    if(!CommandAllowed(verb->flags))
+        return;
+    switch(verb->code) {
+    case gc_help:
         if(is_creator) 
             SendMessage(
                 "# start                 start the game!\n");
@@ -444,8 +559,8 @@ void ManagerGameSession::HandleCommand(const char *a_cmd)
          "#   Monthly expenses are $300 per raw unit, $500 per prod. unit,\n"
          "#                $1000 per plant, $1500 per automatic plant.\n"
         );
-    } else
-    if(cmd[0] == "start") {
+        break;
+    case gc_start:
         if(is_creator) {
             if(the_game->GetNumplayers()>1) {
                 the_game->Start();
@@ -458,114 +573,87 @@ void ManagerGameSession::HandleCommand(const char *a_cmd)
             SendMessage("&- You are not the Creator "
                         "or the game is already started\n"); 
         }
-    } else
-    if(cmd[0] == "quit") {
-         wishes_to_quit = true;
-    } else
-    if(cmd[0] == "buy") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         BuyArrange(cmd[1], cmd[2]);
-    } else
-    if(cmd[0] == "sell") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         SellArrange(cmd[1], cmd[2]);
-    } else
-    if(cmd[0] == "prod") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         ProdArrange(cmd[1]);
-    } else
-    if(cmd[0] == "build") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         BuildArrange(false);
-    } else
-    if(cmd[0] == "abuild") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         BuildArrange(true);
-    } else
-    if(cmd[0] == "upgrade") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         UpgradeArrange();
-    } else
-    if(cmd[0] == "turn") {
-         MUST_BE_ACTIVE
-         MUST_BE_PLAYED
-         MUST_BE_TURN
-         is_turn_ended = true;
-         the_game->CheckEndTurn(); 
-    } else
-    if(cmd[0] == "market") {
-         MUST_BE_PLAYED
-         int raw, rawpr, prod, prodpr;
-         the_game->GetMarket()->
-              GetLevelParameters(the_game->GetAlivePlayers(), 
-                                 raw, rawpr, prod, prodpr);
-         ScriptVariable head(80, "%-10s %8s %9s  %8s %9s\n", 
-                     "# ------", "Raw", "MinPrice", "Prod", "MaxPrice");
-         ScriptVariable info(80, "%-10s %8d %9d  %8d %9d\n", 
-                     "& MARKET", raw, rawpr, prod, prodpr);
-         SendMessage(head.c_str());
-         SendMessage(info.c_str());
-         SendMessage("# ------ \n");
-    } else
-    if(cmd[0] == "info") {
-         the_game->SendMeInfo(this);
-    } else 
-    if(cmd[0] == "?") {
-         MUST_BE_PLAYED
-         MUST_BE_ACTIVE
-         ScriptVariable info(80, "# Requested: "
-                                 "buy %d (for $%d per item) "
-                                 "sell %d (for $%d per item) "
-                                 "produce %d\n", 
-                                 raw_request, raw_request_price,
-                                 prod_request, prod_request_price,
-                                 creation_request);
-         SendMessage(info.c_str());
-    } else 
-    if(cmd[0] == "chat") {
-        if(cmd[1] == "on") {
+        break;
+    case gc_quit:
+        wishes_to_quit = true;
+        break;
+    case gc_buy:
+        BuyArrange(cmd);
+        break;
+    case gc_sell:
+        SellArrange(cmd);
+        break;
+    case gc_prod:
+        ProdArrange(cmd);
+        break;
+    case gc_build:
+        BuildArrange(false);
+        break;
+    case gc_abuild:
+        BuildArrange(true);
+        break;
+    case gc_upgrade:
+        UpgradeArrange();
+        break;
+    case gc_turn:
+        is_turn_ended = true;
+        the_game->CheckEndTurn(); 
+        break;
+    case gc_market: {
+        int raw, rawpr, prod, prodpr;
+        the_game->GetMarket()->
+             GetLevelParameters(the_game->GetAlivePlayers(), 
+                                raw, rawpr, prod, prodpr);
+        ScriptVariable head(80, "%-10s %8s %9s  %8s %9s\n", 
+                    "# ------", "Raw", "MinPrice", "Prod", "MaxPrice");
+        ScriptVariable info(80, "%-10s %8d %9d  %8d %9d\n", 
+                    "& MARKET", raw, rawpr, prod, prodpr);
+        SendMessage(head.c_str());
+        SendMessage(info.c_str());
+        SendMessage("# ------ \n");
+        break;
+    }
+    case gc_info:
+        the_game->SendMeInfo(this);
+        break;
+    case gc_requests: {
+        ScriptVariable info(80, "# Requested: "
+                                "buy %d (for $%d per item) "
+                                "sell %d (for $%d per item) "
+                                "produce %d\n", 
+                                raw_request, raw_request_price,
+                                prod_request, prod_request_price,
+                                creation_request);
+        SendMessage(info.c_str());
+        break;
+    }
+    case gc_chat:
+        if(cmd.Is(1, "on")) {
             chat_mode = chat_on;
+            NotifyChatState();
             SendMessage("& OK chat is now on\n");
         } else 
-        if(cmd[1] == "off") {
+        if(cmd.Is(1, "off")) {
             chat_mode = chat_off;
+            NotifyChatState();
             SendMessage("& OK chat is now off\n");
         } else 
         {
             SendMessage("&- use 'chat on' or 'chat off'\n");
         }
-    } else 
-    if(cmd[0] == "say") {
+        break;
+    case gc_say: {
         ScriptVariable sv("# <");
         sv += GetName();
         sv += "> ";
-        for(int i=1; i<cmd.Length(); i++) {
-            sv += cmd[i];
-            sv += " ";
-        }
+        cmd.AppendWords(sv, 1);
         sv += "\n";
         the_game->Broadcast(sv.c_str());
-    } else 
-    {
-        SendMessage("&- Unknown command\n");
+        break;
+    }
     }
     SendPrompt();
 }
-#undef MUST_BE_PLAYED
-#undef MUST_BE_TURN
-#undef MUST_BE_ACTIVE
 
 void ManagerGameSession::TurnEnd()
 {
@@ -733,10 +821,10 @@ void ManagerGameSession::GetPlants(int &ordinary, int &autopl) const
 }
 
 void ManagerGameSession::
-BuyArrange(const ScriptVariable &n, const ScriptVariable &pr)
+BuyArrange(const CommandLine &cmd)
 {   
     long amount, price;
-    if(!n.GetLong(amount) || !pr.GetLong(price)) {
+    if(!cmd.GetLong(1, amount) || !cmd.GetLong(2, price)) {
         SendMessage("&- you must give two numbers (amount and price)\n");
         return;
     }
@@ -757,10 +845,10 @@ BuyArrange(const ScriptVariable &n, const ScriptVariable &pr)
 }
 
 void ManagerGameSession::
-SellArrange(const ScriptVariable &n, const ScriptVariable &pr)
+SellArrange(const CommandLine &cmd)
 {
     long amount, price;
-    if(!n.GetLong(amount) || !pr.GetLong(price)) {
+    if(!cmd.GetLong(1, amount) || !cmd.GetLong(2, price)) {
         SendMessage("&- you must give two numbers (amount and price)\n");
         return;
     }
@@ -784,10 +872,10 @@ SellArrange(const ScriptVariable &n, const ScriptVariable &pr)
     SendMessage("& OK   -- your request is accepted\n");
 }
 
-void ManagerGameSession::ProdArrange(const ScriptVariable &n)
+void ManagerGameSession::ProdArrange(const CommandLine &cmd)
 {
     long amount;
-    if(!n.GetLong(amount)) {
+    if(!cmd.GetLong(1, amount)) {
         SendMessage("&- you must give a number (amount)\n");
         return;
     }
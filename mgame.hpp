@@ -19,10 +19,12 @@
 
 #include "scriptpp/scrvar.hpp"
 #include "session.hpp"
+#include "cmdline.hpp"
 
 #define MAX_PLANTS 100
 
-class ManagerGame : public AbstractGame {
+  // the end of a turn is done in slices, see Step()
+class ManagerGame : public AbstractGame, private GameTask {
     enum game_status { 
         gs_notstarted,
         gs_playing,
@@ -30,6 +32,13 @@ class ManagerGame : public AbstractGame {
         gs_aborted
     } state; 
 
+    enum endturn_phase {
+        et_none,
+        et_trade,
+        et_players,
+        et_results
+    } endturn; 
+
     ScriptVariable status_message;
     class Market *market;
 
@@ -38,6 +47,8 @@ class ManagerGame : public AbstractGame {
         class ManagerGameSession *sess;
     };
     Item *first;
+      // the next player to finish the turn for, in the et_players phase
+    Item *endturn_next;
 
 public:
     ManagerGame(int seqn);
@@ -59,6 +70,7 @@ public:
 
     bool IsStarted() const { return state != gs_notstarted; }
     bool IsFinished() const { return state == gs_finished; }
+    bool IsTurnInProgress() const { return endturn != et_none; }
     void CheckEndTurn();
     void DoEndTurn();
 
@@ -67,6 +79,13 @@ public:
     void SendMeInfo(class ManagerGameSession *sess);
 
     void Broadcast(const char *msg) const;
+
+private:
+    /* from GameTask */
+    virtual bool Step();
+
+    void EndTurnTrade();
+    void EndTurnResults();
 };
 
 
@@ -139,9 +158,11 @@ private:
     void SendPrompt();
     void ClearRequests();
 
-    void BuyArrange(const ScriptVariable &n, const ScriptVariable &pr);
-    void SellArrange(const ScriptVariable &n, const ScriptVariable &pr);
-    void ProdArrange(const ScriptVariable &n);
+    bool CommandAllowed(unsigned int flags);
+    bool GameIsPlayed();
+    void BuyArrange(const CommandLine &cmd);
+    void SellArrange(const CommandLine &cmd);
+    void ProdArrange(const CommandLine &cmd);
     void BuildArrange(bool auto_plant);
     void UpgradeArrange();
 };
@@ -33,7 +33,9 @@ struct ScriptVariableImplementation {
     char buf[1];
 };
 
-static ScriptVariableImplementation TheEmptyString = { 1, 0, "" };
+  // The empty string is shared by all threads, so its reference counter
+  // is never touched (it is kept above 1 so nobody modifies it in place)
+static ScriptVariableImplementation TheEmptyString = { 2, 0, "" };
 
 
 ScriptVariable::ScriptVariable()
@@ -97,7 +99,7 @@ ScriptVariable::~ScriptVariable()
 void ScriptVariable::Unlink()
 {
     if(p) {
-        if(--(p->refcount)<=0) free(p);
+        if(p != &TheEmptyString && --(p->refcount)<=0) free(p);
         p = 0;
     }
 }
@@ -106,7 +108,7 @@ void ScriptVariable::Assign(ScriptVariableImplementation *q)
 {
     Unlink();
     p = q;
-    if(p)
+    if(p && p != &TheEmptyString)
         p->refcount++;
 }
 
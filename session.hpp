@@ -17,15 +17,42 @@
 #ifndef SESSION_HPP_SENTRY
 #define SESSION_HPP_SENTRY
 
+  // a text printed to many clients at once; the server may make a 
+  // single copy of it shared by all of them, instead of a copy each
+class BroadcastText {
+public:
+    class SharedCopy {
+    public:
+        virtual ~SharedCopy() {}
+    };
+private:
+    const char *text;
+    SharedCopy *copy;
+public:
+    BroadcastText(const char *a_text) : text(a_text), copy(0) {}
+    ~BroadcastText() { if(copy) delete copy; }
+
+    const char *c_str() const { return text; }
+    SharedCopy *GetCopy() const { return copy; }
+    void SetCopy(SharedCopy *c) { copy = c; }
+private:
+    BroadcastText(const BroadcastText&);
+    void operator=(const BroadcastText&);
+};
+
 class PlayingClient {
 public:
     PlayingClient() {}
     virtual ~PlayingClient() {}
 
     virtual void Print(const char *) = 0;
+    virtual void PrintBroadcast(BroadcastText &text) { Print(text.c_str()); }
     virtual void Broadcast(const char *) = 0;
 
     virtual const char *GetName() const = 0;
+
+      // what the game's ChatAccepted() says may have changed
+    virtual void ChatStateChanged() {}
 };
 
 
@@ -45,18 +72,56 @@ public:
 
     void SendMessage(const char *msg) const 
         { the_client->Print(msg); }
+    void SendBroadcast(BroadcastText &text) const 
+        { the_client->PrintBroadcast(text); }
+    void NotifyChatState() const
+        { the_client->ChatStateChanged(); }
+
+};
+
+  // a piece of work a game wants to get done in slices, so that the
+  // server serves other clients in between
+class GameTask {
+public:
+    GameTask() {}
+    virtual ~GameTask() {}
+
+      // do the next slice; false means there's nothing left to do
+    virtual bool Step() = 0;
+};
+
+  // the server's facility to run GameTask objects
+class GameTaskRunner {
+public:
+    GameTaskRunner() {}
+    virtual ~GameTaskRunner() {}
 
+      // call task->Step() repeatedly, until it returns false 
+    virtual void StartTask(GameTask *task) = 0;
+      // don't touch the task anymore, it is going to be deleted
+    virtual void StopTask(GameTask *task) = 0;
 };
 
 class AbstractGame {
     int seqnum;
+    GameTaskRunner *the_runner;
 public:
-    AbstractGame(int n) : seqnum(n) {}
+    AbstractGame(int n) : seqnum(n), the_runner(0) {}
     virtual ~AbstractGame() {}
 
     virtual bool ZombieState() const = 0;
 
     int GetSeqnum() const { return seqnum; }
+
+    void SetTaskRunner(GameTaskRunner *r) { the_runner = r; }
+
+protected:
+      // without a runner, the whole work is done right now
+    void StartTask(GameTask *task) 
+        { if(the_runner) the_runner->StartTask(task); 
+          else while(task->Step()) {} }
+    void StopTask(GameTask *task) 
+        { if(the_runner) the_runner->StopTask(task); }
 };
 
 
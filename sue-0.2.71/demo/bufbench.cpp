@@ -0,0 +1,120 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+
+/* This program measures how long it takes to drain a large backlog
+   from a SUEBuffer: first in pieces of the size a partial write(2) to
+   a slow client typically takes, then line by line as a session reads
+   commands pasted by a client (copying them out, then right in the 
+   buffer); then it reads a single long line arriving by small pieces,
+   trying to read it after each piece.  Give the backlog size (in 
+   kilobytes) as the argument; the default is 200.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sue_sess.hpp"
+
+static double now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void fill(SUEBuffer &buf, int bytes)
+{
+    static const char line[] = 
+        "% somebody tells you: the quick brown fox jumps\r\n";
+    while(buf.Length() < bytes)
+        buf.AddString(line);
+}
+
+int main(int argc, char **argv) 
+{
+    int kbytes = argc > 1 ? atoi(argv[1]) : 200;
+    if(kbytes <= 0) {
+        fprintf(stderr, "Usage: %s [kbytes]\n", argv[0]);
+        return 1;
+    }
+    SUEBuffer buf;
+
+    fill(buf, kbytes * 1024);
+    int total = buf.Length();
+    int pieces = 0;
+    double start = now_usec();
+    while(buf.Length() > 0) {
+        buf.DropData(1448);    // what's left after a partial write
+        pieces++;
+    }
+    double t = now_usec() - start;
+    printf("%d bytes in %d pieces: %.0f us, %.1f ns per piece\n",
+           total, pieces, t, t * 1000 / pieces);
+
+    fill(buf, kbytes * 1024);
+    total = buf.Length();
+    int lines = 0;
+    char line[256];
+    start = now_usec();
+    while(buf.ReadLine(line, sizeof(line)) > 0)
+        lines++;
+    t = now_usec() - start;
+    printf("%d bytes in %d lines: %.0f us, %.1f ns per line\n",
+           total, lines, t, t * 1000 / lines);
+
+    fill(buf, kbytes * 1024);
+    total = buf.Length();
+    lines = 0;
+    int pos = 0, len;
+    start = now_usec();
+    while(buf.NextLine(pos, len))
+        lines++;
+    buf.DropData(pos);
+    t = now_usec() - start;
+    printf("%d bytes in %d lines in place: %.0f us, %.1f ns per line\n",
+           total, lines, t, t * 1000 / lines);
+
+      // a steady backlog: the producer is slightly ahead of the consumer
+    int rounds = kbytes * 100;
+    start = now_usec();
+    for(int i = 0; i < rounds; i++) {
+        fill(buf, buf.Length() + 1);
+        buf.DropData(40);
+    }
+    t = now_usec() - start;
+    printf("%d add/drop rounds with %d bytes left: %.0f us, "
+           "%.1f ns per round\n", rounds, buf.Length(), t, t * 1000 / rounds);
+
+    buf.DropAll();
+    SUEBuffer dest;
+    int tries = 0;
+    start = now_usec();
+    for(;;) {
+        if(buf.Length() >= kbytes * 1024)
+            buf.AddChar('\n');
+        else
+            buf.AddData("the quick brown fox jumps", 24);
+        tries++;
+        if(buf.ReadLine(dest))
+            break;
+    }
+    t = now_usec() - start;
+    printf("%d bytes line in %d pieces: %.0f us, %.1f ns per piece\n",
+           dest.Length(), tries, t, t * 1000 / tries);
+    return 0;
+}
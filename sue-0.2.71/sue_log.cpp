@@ -0,0 +1,377 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && !defined(SUE_NO_EVENTFD)
+#define SUE_HAVE_EVENTFD 1
+#include <sys/eventfd.h>
+#endif
+
+#include "sue_log.hpp"
+
+
+  // how much the writer collects before it calls write(2)
+static const int batch_size = 65536;
+
+
+SUELogger::SUELogger()
+{
+    ring = new Slot[SUE_LOG_RING];
+    for(int i = 0; i < SUE_LOG_RING; i++)
+        ring[i].seq = i;
+    head = 0;
+    tail = 0;
+    dropped = 0;
+    dropreported = 0;
+    truncated = 0;
+    truncreported = 0;
+    midline = false;
+    level = log_info;
+    filename = 0;
+    maxsize = 0;
+    keep = 0;
+    fd = -1;
+    size = 0;
+    sleeping = 0;
+    wakefd = -1;
+    waitfd = -1;
+    running = false;
+    stopping = 0;
+}
+
+SUELogger::~SUELogger()
+{
+    Stop();
+    delete[] ring;
+    if(filename)
+        free(filename);
+}
+
+bool SUELogger::Start(const char *a_filename, long a_maxsize, int a_keep)
+{
+    if(running)
+        return true;
+    if(filename)
+        free(filename);
+    filename = a_filename ? strdup(a_filename) : 0;
+    maxsize = a_maxsize;
+    keep = a_keep;
+    if(filename) {
+        if(!OpenFile())
+            return false;
+    } else {
+        fd = 2;
+    }
+#ifdef SUE_HAVE_EVENTFD
+    waitfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wakefd = waitfd;
+#endif
+    if(waitfd == -1) {
+        int fds[2];
+        if(-1 == pipe(fds))
+            return false;
+        for(int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        waitfd = fds[0];
+        wakefd = fds[1];
+    }
+    stopping = 0;
+    // the new thread inherits the signal mask, so block everything
+    // for the time we create it
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int rc = pthread_create(&thread, 0, ThreadMain, this);
+    pthread_sigmask(SIG_SETMASK, &saved, 0);
+    if(rc != 0)
+        return false;
+    running = true;
+    return true;
+}
+
+void SUELogger::Stop()
+{
+    if(!running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    Wake();
+    pthread_join(thread, 0);
+    running = false;
+    if(wakefd != waitfd)
+        close(wakefd);
+    close(waitfd);
+    wakefd = waitfd = -1;
+    if(fd != -1 && fd != 2)
+        close(fd);
+    fd = -1;
+}
+
+  /* The ring is the bounded queue by Dmitry Vyukov: the sequence number
+     of a slot tells whether the slot is free for the producer which
+     claims the position (seq == pos), or holds a line to be taken by
+     the writer (seq == pos + 1).  The producers claim positions by
+     advancing the head with compare-and-swap; a long line takes 
+     several consecutive positions at once, so the writer gets its 
+     parts one right after another.
+   */
+void SUELogger::Log(Level a_level, const char *fmt, ...)
+{
+    if(a_level < level)
+        return;
+    char buf[SUE_LOG_LONGEST];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(len < 0)
+        len = 0;
+    if(len > (int)sizeof(buf) - 1) {
+        len = sizeof(buf) - 1;
+        __atomic_add_fetch(&truncated, 1, __ATOMIC_RELAXED);
+    }
+    while(len > 0 && buf[len-1] == '\n')
+        len--;
+    int count = len > 0 ? (len + SUE_LOG_LINE - 1) / SUE_LOG_LINE : 1;
+    if(count > SUE_LOG_RING) {
+        count = SUE_LOG_RING;
+        len = count * SUE_LOG_LINE;
+        __atomic_add_fetch(&truncated, 1, __ATOMIC_RELAXED);
+    }
+    unsigned long pos;
+    if(!Claim(pos, count)) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    time_t now = time(0);
+    for(int i = 0; i < count; i++) {
+        Slot *s = &ring[(pos + i) % SUE_LOG_RING];
+        int part = len - i * SUE_LOG_LINE;
+        if(part > SUE_LOG_LINE)
+            part = SUE_LOG_LINE;
+        s->when = now;
+        memcpy(s->text, buf + i * SUE_LOG_LINE, part);
+        s->len = part;
+        s->cont = i < count - 1;
+        __atomic_store_n(&s->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    // pairs with the fence in Wait(): either the writer sees the line,
+    // or we see it's sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && wakefd != -1)
+        Wake();
+}
+
+  // Claims count consecutive positions starting at pos; false if the 
+  // ring is full.  A slot can only be taken by a producer which moves
+  // the head past it, so once the slots are all seen free, the 
+  // compare-and-swap makes them ours.
+bool SUELogger::Claim(unsigned long &pos, int count)
+{
+    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    for(;;) {
+        long dif = 0;
+        int i;
+        for(i = 0; i < count; i++) {
+            Slot *s = &ring[(pos + i) % SUE_LOG_RING];
+            unsigned long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            dif = (long)(seq - (pos + i));
+            if(dif != 0)
+                break;
+        }
+        if(i == count) {
+            if(__atomic_compare_exchange_n(&head, &pos, pos + count, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return true;
+            }
+            // the failed compare-and-swap has reloaded pos
+        } else
+        if(dif < 0) {
+            // the writer has not taken the line from the last round
+            return false;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void SUELogger::Wake()
+{
+#ifdef SUE_HAVE_EVENTFD
+    if(wakefd == waitfd) {
+        eventfd_write(wakefd, 1);
+        return;
+    }
+#endif
+    char c = 1;
+    write(wakefd, &c, 1);
+}
+
+unsigned long SUELogger::GetDropped() const
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+unsigned long SUELogger::GetTruncated() const
+{
+    return __atomic_load_n(&truncated, __ATOMIC_RELAXED);
+}
+
+void *SUELogger::ThreadMain(void *arg)
+{
+    static_cast<SUELogger*>(arg)->Run();
+    return 0;
+}
+
+void SUELogger::Run()
+{
+    char *buf = new char[batch_size];
+    for(;;) {
+        int len = 0, n;
+        while(len < batch_size - SUE_LOG_LINE - 64 &&
+              TakeLine(buf + len, n, batch_size - len))
+        {
+            len += n;
+        }
+        // the reports must not break a line
+        unsigned long d = GetDropped();
+        if(d != dropreported && !midline) {
+            len += snprintf(buf + len, batch_size - len,
+                            "*** %lu log lines dropped\n",
+                            d - dropreported);
+            dropreported = d;
+        }
+        unsigned long t = GetTruncated();
+        if(t != truncreported && !midline) {
+            len += snprintf(buf + len, batch_size - len,
+                            "*** %lu log lines truncated\n",
+                            t - truncreported);
+            truncreported = t;
+        }
+        if(len > 0) {
+            Write(buf, len);
+            continue;
+        }
+        if(__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+            break;
+        Wait();
+    }
+    delete[] buf;
+}
+
+bool SUELogger::TakeLine(char *buf, int &len, int bufsize)
+{
+    Slot *s = &ring[tail % SUE_LOG_RING];
+    if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1)
+        return false;
+    len = 0;
+    if(filename && !midline) {
+        struct tm t;
+        localtime_r(&s->when, &t);
+        len = strftime(buf, bufsize, "%Y-%m-%d %H:%M:%S ", &t);
+    }
+    memcpy(buf + len, s->text, s->len);
+    len += s->len;
+    midline = s->cont;
+    if(!midline)
+        buf[len++] = '\n';
+    __atomic_store_n(&s->seq, tail + SUE_LOG_RING, __ATOMIC_RELEASE);
+    tail++;
+    return true;
+}
+
+void SUELogger::Wait()
+{
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    Slot *s = &ring[tail % SUE_LOG_RING];
+    if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1 &&
+       !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+    {
+        struct pollfd p;
+        p.fd = waitfd;
+        p.events = POLLIN;
+        // the dropped lines are reported within a second anyway
+        poll(&p, 1, 1000);
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+    char drain[64];
+    while(read(waitfd, drain, sizeof(drain)) > 0)
+        ;
+}
+
+void SUELogger::Write(const char *buf, int len)
+{
+    while(len > 0) {
+        int rc = write(fd, buf, len);
+        if(rc == -1) {
+            if(errno == EINTR)
+                continue;
+            return;     // nowhere to complain
+        }
+        buf += rc;
+        len -= rc;
+        size += rc;
+    }
+    if(filename && maxsize > 0 && size >= maxsize && !midline)
+        Rotate();
+}
+
+bool SUELogger::OpenFile()
+{
+    fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd == -1)
+        return false;
+    struct stat st;
+    size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    return true;
+}
+
+void SUELogger::Rotate()
+{
+    close(fd);
+    int len = strlen(filename) + 16;
+    char *from = new char[len];
+    char *to = new char[len];
+    for(int i = keep - 1; i >= 1; i--) {
+        snprintf(from, len, "%s.%d", filename, i);
+        snprintf(to, len, "%s.%d", filename, i + 1);
+        rename(from, to);
+    }
+    if(keep > 0) {
+        snprintf(to, len, "%s.1", filename);
+        rename(filename, to);
+    } else {
+        unlink(filename);
+    }
+    delete[] from;
+    delete[] to;
+    if(!OpenFile())
+        fd = 2;     // better than nothing
+}
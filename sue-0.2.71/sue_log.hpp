@@ -0,0 +1,149 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#ifndef SENTRY_SUE_LOG_HPP
+#define SENTRY_SUE_LOG_HPP
+
+#include <pthread.h>
+#include <time.h>
+
+
+#ifndef SUE_LOG_RING
+  //! How many lines the logger holds before it starts dropping them
+#define SUE_LOG_RING 8192
+#endif
+
+#ifndef SUE_LOG_LINE
+  //! How much of a line a slot of the ring holds
+  /*! Longer lines take several consecutive slots */
+#define SUE_LOG_LINE 240
+#endif
+
+#ifndef SUE_LOG_LONGEST
+  //! The longest line the logger takes, longer ones are truncated
+#define SUE_LOG_LONGEST 4096
+#endif
+
+//! Log written by a thread of its own
+/*! The event loop must not wait for the terminal or the disk, so the
+    lines logged are only put into an in-memory ring, and a background
+    thread writes them out in batches.  Putting a line into the ring
+    is lock-free and never blocks, so Log() may be called by any
+    thread; if the ring is full (that is, the writer can't keep up),
+    the line is dropped and counted.  The count of lines dropped is
+    reported in the log as soon as the writer catches up.  A line 
+    longer than SUE_LOG_LINE takes several slots; the one longer than
+    SUE_LOG_LONGEST is truncated, which is counted and reported the 
+    same way.
+    \par
+    The log is written to stderr unless a file is given to Start().
+    Lines written to a file are prefixed with the time they were
+    logged; once the file grows over the limit given, it is renamed
+    to NAME.1 (the older NAME.1 to NAME.2 and so on), and a new file
+    is started.
+    \note The writer thread doesn't survive fork(2), so in a process
+    which forks, start the logger after forking.
+ */
+class SUELogger {
+public:
+    //! How important the line is
+    enum Level { log_debug, log_info, log_warning, log_error };
+private:
+    struct Slot {
+        unsigned long seq;  // see Log() and TakeLine()
+        time_t when;
+        int len;
+        bool cont;          // the line goes on in the next slot
+        char text[SUE_LOG_LINE];
+    };
+    Slot *ring;
+        //! Where the next line is to be put, taken by the producers
+    unsigned long head;
+        //! Where the next line is to be taken by the writer
+    unsigned long tail;
+    unsigned long dropped, dropreported;
+    unsigned long truncated, truncreported;
+        //! The writer has written a part of a line only
+    bool midline;
+    int level;
+
+    char *filename;
+    long maxsize;
+    int keep;
+    int fd;
+    long size;
+
+        //! Nonzero while the writer waits for lines to come
+    int sleeping;
+    int wakefd, waitfd;
+    bool running;
+    int stopping;
+    pthread_t thread;
+public:
+    SUELogger();
+        //! Destructor
+        /*! Stops the writer, see Stop() */
+    ~SUELogger();
+
+        //! Don't log lines less important than the given level
+        /*! The default level is log_info. */
+    void SetLevel(Level a_level) { level = a_level; }
+    Level GetLevel() const { return (Level)level; }
+
+        //! Start the writer thread
+        /*! \param a_filename is the file to append the log to;
+            0 means stderr
+            \param a_maxsize is the size (in bytes) after which the
+            file is rotated; 0 means never
+            \param a_keep is how many old files to keep
+            Returns false if the file couldn't be opened or the thread
+            couldn't be created.  The lines logged before Start() are
+            kept in the ring (unless dropped) and written afterwards.
+         */
+    bool Start(const char *a_filename = 0, long a_maxsize = 0,
+               int a_keep = 5);
+        //! Write out everything logged and stop the writer thread
+    void Stop();
+
+        //! Log a line, printf(3)-like
+        /*! May be called by any thread.  The trailing newline, if
+            any, is removed, and the writer adds one.
+         */
+    void Log(Level a_level, const char *fmt, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf, 3, 4)))
+#endif
+        ;
+
+        //! How many lines were dropped for the ring being full
+    unsigned long GetDropped() const;
+        //! How many lines were truncated to SUE_LOG_LONGEST
+    unsigned long GetTruncated() const;
+
+private:
+    static void *ThreadMain(void *arg);
+    void Run();
+    bool TakeLine(char *buf, int &len, int bufsize);
+    bool Claim(unsigned long &pos, int count);
+    void Write(const char *buf, int len);
+    bool OpenFile();
+    void Rotate();
+    void Wait();
+    void Wake();
+};
+
+#endif
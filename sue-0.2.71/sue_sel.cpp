@@ -18,87 +18,327 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include <fcntl.h>
+
+#if defined(__linux__) && !defined(SUE_NO_EPOLL)
+#define SUE_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+#if defined(__linux__) && !defined(SUE_NO_SIGNALFD)
+#define SUE_HAVE_SIGNALFD 1
+#include <sys/signalfd.h>
+#include <pthread.h>
+#endif
+
+#ifndef SUE_NO_STATS
+#define SUE_HAVE_STATS 1
+#include <typeinfo>
+#endif
+
 #include "sue_sel.hpp"
+#include "sue_uring.hpp"
+#include "sue_sess.hpp"
 
 
-// this class is used internally by the library
-class SUESignalQueue {
+#ifndef SUE_EPOLL_EVENTS_PER_CALL
+#define SUE_EPOLL_EVENTS_PER_CALL 256
+#endif
+
+#ifndef SUE_TASK_BUDGET
+#define SUE_TASK_BUDGET 2000
+#endif
+
+
+struct SelectDescriptorsSet {
+    fd_set readfds;
+    fd_set writefds;
+    fd_set exceptfds;
+};
+
+
+// The clock
+
+static void read_clock(long &sec, long &usec)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        sec = ts.tv_sec;
+        usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    struct timeval current;
+    int rc = gettimeofday(&current, 0 /* timezone unused */);
+    if(rc != 0) 
+        throw SUEException("gettimeofday failed");
+    sec = current.tv_sec;
+    usec = current.tv_usec;
+}
+
+#if defined(__GNUC__) && !defined(SUE_NO_TLS)
+  // the selector running its main loop in this thread, if any
+static __thread const SUEEventSelector *the_running_selector = 0;
+#define SUE_HAVE_TLS 1
+#endif
+
+  // the handlers don't know their selector, so they ask the thread's one
+static void get_current_time(long &sec, long &usec)
+{
+#ifdef SUE_HAVE_TLS
+    if(the_running_selector) {
+        the_running_selector->GetCurrentTime(sec, usec);
+        return;
+    }
+#endif
+    read_clock(sec, usec);
+}
+
+
+// Statistics
+
+static unsigned long long monotonic_ns()
+{
+    long sec, usec;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    read_clock(sec, usec);
+    return (unsigned long long)sec * 1000000000 + usec * 1000;
+}
+
+  // callbacks are timed with the cheapest clock there is
+static inline unsigned long long stats_ticks()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
 
-#   ifndef SUE_MAX_SIGNAL_QUEUE_SIZE
-#   define SUE_MAX_SIGNAL_QUEUE_SIZE 1024
-#   endif
+#ifdef SUE_HAVE_STATS
+static inline int stats_bucket(unsigned long long value)
+{
+    if(!value)
+        return 0;
+    int b = 64 - __builtin_clzll(value);
+    return b < SUESelectorStats::histogram_size ? 
+        b : SUESelectorStats::histogram_size - 1;
+}
+#endif
 
-    sig_atomic_t queue[SUE_MAX_SIGNAL_QUEUE_SIZE];
-    sig_atomic_t que_p1, que_p2;
 
+// this class is used internally by the library
+/* Signals are delivered through a descriptor which the selector watches
+   just like any other one.  On Linux, signalfd(2) is used, so the handled
+   signals are blocked and no asynchronous handler is ever called.  
+   Elsewhere (or if signalfd(2) fails), the classic self-pipe trick is used:
+   the asynchronous handler raises a flag and writes a byte into a pipe.
+   Either way, several occurences of the same signal which come before 
+   the selector reads the descriptor are coalesced into one notification.
+   The signals blocked for signalfd(2) are unblocked in the child 
+   processes, as the programs they exec know nothing about the descriptor,
+   and the child drops the inherited signalfd (see ForkedChild()).
+ */
+class SUESignalQueue {
     static void TheHandlingFunction(int signo);
-    
+
     sigset_t current;
+    int readfd;         // signalfd, or the read end of the pipe
+    int writefd;        // the write end of the pipe, -1 for signalfd
+    volatile sig_atomic_t pending[NSIG];  // used with the pipe only
     
 public:
     SUESignalQueue() {
-        que_p1 = que_p2 = 0; 
         sigemptyset(&current);
+        readfd = writefd = -1;
+        for(int i=0; i<NSIG; i++) pending[i] = 0;
     }
     ~SUESignalQueue() {
         RemoveAll();
+        if(readfd != -1) close(readfd);
+        if(writefd != -1) close(writefd);
     }
     
+    int GetFd() {
+        if(readfd == -1) Open();
+        return readfd;
+    }
+
     void Add(int signo) { 
-        struct sigaction sa;
-        sa.sa_handler = TheHandlingFunction;
-        sigfillset(&(sa.sa_mask));
-        sa.sa_flags = 0;
-        sigaction(signo, &sa, 0);
+        if(readfd == -1) Open();
         sigaddset(&current, signo); 
+        if(writefd == -1) {
+#ifdef SUE_HAVE_SIGNALFD
+            sigset_t set, old;
+            sigemptyset(&set);
+            sigaddset(&set, signo);
+            sigprocmask(SIG_BLOCK, &set, &old);
+            if(!sigismember(&old, signo))
+                sigaddset(&blocked, signo);
+            signalfd(readfd, &current, 0);
+#endif
+        } else {
+            struct sigaction sa;
+            sa.sa_handler = TheHandlingFunction;
+            sigfillset(&(sa.sa_mask));
+            sa.sa_flags = SA_RESTART;
+            sigaction(signo, &sa, 0);
+        }
     }
 
     void Remove(int signo) { 
-        struct sigaction sa;
         sigdelset(&current, signo); 
-        sa.sa_handler = SIG_DFL;
-        sigfillset(&(sa.sa_mask));
-        sa.sa_flags = 0;
-        sigaction(signo, &sa, 0);
+        if(writefd == -1) {
+#ifdef SUE_HAVE_SIGNALFD
+            signalfd(readfd, &current, 0);
+            if(sigismember(&blocked, signo)) {
+                sigset_t set;
+                sigemptyset(&set);
+                sigaddset(&set, signo);
+                sigprocmask(SIG_UNBLOCK, &set, 0);
+                sigdelset(&blocked, signo);
+            }
+#endif
+        } else {
+            struct sigaction sa;
+            sa.sa_handler = SIG_DFL;
+            sigfillset(&(sa.sa_mask));
+            sa.sa_flags = 0;
+            sigaction(signo, &sa, 0);
+        }
     }
 
     void RemoveAll() { 
-        for(unsigned int i=1; i<=(sizeof(current)+7)/8; i++)
+        for(int i=1; i<NSIG; i++)
             if(sigismember(&current, i)) Remove(i);
     }
 
-    bool FetchSignalEvent(int &signo) {
-        if(que_p1==que_p2) return false;
-        signo = queue[que_p1];
-        que_p1++;
-        if(que_p1>=SUE_MAX_SIGNAL_QUEUE_SIZE) que_p1=0;
-        return true;
-    }
+        // Drains the descriptor; fired[signo] is set to true for 
+        // every signal which came; returns false if there were none
+    bool FetchSignals(bool *fired);
     
 private:
-    void AddEvent(int signo) {
-        int i = que_p2++;
-        if(que_p2>=SUE_MAX_SIGNAL_QUEUE_SIZE) que_p1=0;
-        if(que_p2==que_p1) { // no more space in the queue
-            // just refuse to store the signal
-            que_p2 = i;
-            return; 
-        } 
-        queue[i]=signo;
-    }
+    void Open();
+#ifdef SUE_HAVE_SIGNALFD
+        // the signals we blocked, which weren't blocked before
+    static sigset_t blocked;
+    static void ForkedChild();
+#endif
 };
 
+#ifdef SUE_HAVE_SIGNALFD
+sigset_t SUESignalQueue::blocked;
+#endif
+
+void SUESignalQueue::Open()
+{
+#ifdef SUE_HAVE_SIGNALFD
+    sigset_t empty;
+    sigemptyset(&empty);
+    readfd = signalfd(-1, &empty, SFD_NONBLOCK|SFD_CLOEXEC);
+    if(readfd != -1) {
+        static bool atfork_done = false;
+        if(!atfork_done) {
+            sigemptyset(&blocked);
+            pthread_atfork(0, 0, ForkedChild);
+            atfork_done = true;
+        }
+        return;
+    }
+#endif
+    int fds[2];
+    if(pipe(fds) == -1) 
+        throw SUEException("can't create pipe for signal delivery");
+    readfd = fds[0];
+    writefd = fds[1];
+    for(int i=0; i<2; i++) {
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+bool SUESignalQueue::FetchSignals(bool *fired)
+{
+    bool res = false;
+#ifdef SUE_HAVE_SIGNALFD
+    if(writefd == -1) {
+        struct signalfd_siginfo si[16];
+        int rc;
+        while((rc = read(readfd, si, sizeof(si))) > 0) {
+            for(int i=0; i < rc / (int)sizeof(si[0]); i++) {
+                int signo = si[i].ssi_signo;
+                if(signo > 0 && signo < NSIG) {
+                    fired[signo] = true;
+                    res = true;
+                }
+            }
+        }
+        return res;
+    }
+#endif
+    char buf[64];
+    while(read(readfd, buf, sizeof(buf)) > 0)
+        {}
+    // the flags are checked after the pipe is drained, so a signal
+    // which comes right now is either seen here or wakes us up again
+    for(int i=1; i<NSIG; i++) {
+        if(pending[i]) {
+            pending[i] = 0;
+            fired[i] = true;
+            res = true;
+        }
+    }
+    return res;
+}
+
 static SUESignalQueue TheSignalQueue;
 
 void SUESignalQueue::TheHandlingFunction(int signo)
 {
-    TheSignalQueue.AddEvent(signo);
+    int save_errno = errno;
+    TheSignalQueue.pending[signo] = 1;
+    // if the pipe is full, the selector is going to wake up anyway
+    write(TheSignalQueue.writefd, "", 1);
+    errno = save_errno;
+}
+
+#ifdef SUE_HAVE_SIGNALFD
+void SUESignalQueue::ForkedChild()
+{
+    sigprocmask(SIG_UNBLOCK, &blocked, 0);
+    sigemptyset(&blocked);
+    // the signalfd is shared with the parent, so changing its mask here
+    // (e.g. from the destructor on exit()) would steal the parent's 
+    // signals; the child gets a descriptor of its own on the next Add()
+    if(TheSignalQueue.writefd == -1 && TheSignalQueue.readfd != -1) {
+        close(TheSignalQueue.readfd);
+        TheSignalQueue.readfd = -1;
+        sigemptyset(&TheSignalQueue.current);
+    }
 }
+#endif
+
+
+// this class is used internally by the library
+class SUESignalFdHandler : public SUEFdHandler {
+    SUEEventSelector *the_selector;
+public:
+    SUESignalFdHandler(SUEEventSelector *a_sel, int a_fd)
+        : SUEFdHandler(a_fd), the_selector(a_sel) { TrackInterest(); }
+    virtual void FdHandle(bool a_r, bool a_w, bool a_ex)
+        { the_selector->HandleSignals(); }
+};
 
 
 
@@ -107,6 +347,14 @@ void SUESignalQueue::TheHandlingFunction(int signo)
 SUEFdHandler::SUEFdHandler(int a_fd)
 {
     fd = a_fd; 
+    registered_with = 0;
+    tracks_interest = false;
+}
+
+void SUEFdHandler::InterestChanged()
+{
+    if(registered_with)
+        registered_with->InterestChanged(this);
 }
 
 SUEFdHandler::~SUEFdHandler()
@@ -118,11 +366,15 @@ SUEFdHandler::~SUEFdHandler()
 SUETimeoutHandler::SUETimeoutHandler(long a_sec, long a_usec)
 {
     sec = a_sec; usec = a_usec; 
+    slack = 0;
+    heapindex = -1;
 }
 
 SUETimeoutHandler::SUETimeoutHandler()
 {
     sec = -1; usec = -1; 
+    slack = 0;
+    heapindex = -1;
 }
 
 SUETimeoutHandler::~SUETimeoutHandler()
@@ -135,14 +387,19 @@ void SUETimeoutHandler::Set(long a_sec, long a_usec)
 
 void SUETimeoutHandler::SetFromNow(long a_sec, long a_usec)
 {
-    struct timeval current;
-    gettimeofday(&current, 0 /* timezone unused */);
-    sec = current.tv_sec + a_sec; 
-    usec = current.tv_usec + a_usec;
+    get_current_time(sec, usec);
+    sec += a_sec; 
+    usec += a_usec;
     if(usec >= 1000000) {
         sec += usec / 1000000;
         usec = usec % 1000000;
     }
+    if(slack > 0) {
+        long long t = (long long)sec * 1000000 + usec;
+        t = (t + slack - 1) / slack * slack;
+        sec = t / 1000000;
+        usec = t % 1000000;
+    }
 }
 
 void SUETimeoutHandler::Get(long &a_sec, long &a_usec) const
@@ -153,10 +410,10 @@ void SUETimeoutHandler::Get(long &a_sec, long &a_usec) const
 
 void SUETimeoutHandler::GetRemainingTime(long &a_sec, long &a_usec) const
 {
-    struct timeval current;
-    gettimeofday(&current, 0 /* timezone unused */);
-    a_sec = sec - current.tv_sec;
-    a_usec = usec - current.tv_usec;
+    long cur_sec, cur_usec;
+    get_current_time(cur_sec, cur_usec);
+    a_sec = sec - cur_sec;
+    a_usec = usec - cur_usec;
     if(a_usec < 0) {
         a_usec += 1000000;
         a_sec -= 1;
@@ -166,84 +423,293 @@ void SUETimeoutHandler::GetRemainingTime(long &a_sec, long &a_usec) const
 
 // SUESelector
 
-SUEEventSelector::SUEEventSelector()
+SUEEventSelector::SUEEventSelector(Backend a_backend)
 {
-    timeouts = 0;
+    timeoutscount = 0;
+    timeoutssize = 16;
+    timeouts = new TimeoutsHeapItem [timeoutssize];
     signalhandlers = 0;
+    signalfdhandler = 0;
     loophooks = 0;
+    for(int p=0; p<task_priorities; p++) 
+        taskqueues[p].first = taskqueues[p].last = 0;
+    taskscount = 0;
+    taskbudget = SUE_TASK_BUDGET;
+    firstflush = 0;
     fdhandlerssize = 10; // It's unlikely that there will be more FDs
-    fdhandlers = new SUEFdHandler* [fdhandlerssize];
-    int i; for (i=0; i<fdhandlerssize; i++) fdhandlers[i]=0;
+    fdhandlers = new FdHandlerSlot [fdhandlerssize];
+    int i; 
+    for (i=0; i<fdhandlerssize; i++) {
+        fdhandlers[i].handler = 0;
+        fdhandlers[i].mask = -1;
+        fdhandlers[i].readypos = -1;
+        fdhandlers[i].listpos = -1;
+    }
+    polledfds = new int[fdhandlerssize];
+    polledcount = 0;
+    dirtyfds = new int[fdhandlerssize];
+    dirtycount = 0;
+    readylistsize = 16;
+    readylist = new ReadyListItem [readylistsize];
+    readycount = 0;
+    epollfd = -1;
+    epollevents = 0;
+    UpdateCurrentTime();
+    ResetStats();
+#ifdef SUE_HAVE_EPOLL
+    if(a_backend != backend_select) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if(epollfd != -1)
+            epollevents = new epoll_event[SUE_EPOLL_EVENTS_PER_CALL];
+        // in case of failure, silently fall back to select(2)
+    }
+#endif
+    selectsets = 0;
+    if(epollfd == -1) {
+        selectsets = new SelectDescriptorsSet;
+        FD_ZERO(&selectsets->readfds);
+        FD_ZERO(&selectsets->writefds);
+        FD_ZERO(&selectsets->exceptfds);
+    }
+    bufferpool = 0;
+    uring = 0;
+    if(a_backend == backend_uring) {
+        uring = new SUEUring;
+        if(!uring->Setup(this)) {
+            delete uring;
+            uring = 0;
+        }
+    }
 }
 
 SUEEventSelector::~SUEEventSelector()
 {
-    while(timeouts) {
-        TimeoutsListItem *tmp = timeouts->next;
-        delete timeouts;
-        timeouts = tmp;
-    } 
+    if(bufferpool)
+        delete bufferpool;
+    if(uring)
+        delete uring;
+    delete [] timeouts;
+    if(signalfdhandler) {
+        RemoveFdHandler(signalfdhandler);
+        delete signalfdhandler;
+    }
     delete [] fdhandlers;
+    delete [] polledfds;
+    delete [] dirtyfds;
+    if(selectsets)
+        delete selectsets;
+    delete [] readylist;
+#ifdef SUE_HAVE_EPOLL
+    if(epollfd != -1) {
+        close(epollfd);
+        delete [] epollevents;
+    }
+#endif
+}
+
+SUEBufferPool *SUEEventSelector::GetBufferPool()
+{
+    if(!bufferpool)
+        bufferpool = new SUEBufferPool(this);
+    return bufferpool;
 }
 
 void SUEEventSelector::RegisterFdHandler(SUEFdHandler *h)
 {
-    if(h->fd >= fdhandlerssize) 
-        ResizeFdHandlers(h->fd+1);
-    if(fdhandlers[h->fd]) // error, duplicate handler
+    if(epollfd == -1 && h->fd >= FD_SETSIZE)
+        throw SUEException("fd exceeds FD_SETSIZE, select(2) can't watch it");
+    if(h->fd >= fdhandlerssize) {
+        // doubled, or else registering N descriptors one by one would
+        // copy the arrays N times; select(2) needs no more than it takes
+        int newsize = 2 * fdhandlerssize;
+        if(epollfd == -1 && newsize > FD_SETSIZE)
+            newsize = FD_SETSIZE;
+        if(newsize < h->fd+1)
+            newsize = h->fd+1;
+        ResizeFdHandlers(newsize);
+    }
+    if(fdhandlers[h->fd].handler) // error, duplicate handler
         throw SUEException("duplicate fd handler");
-    fdhandlers[h->fd] = h;
+    FdHandlerSlot &slot = fdhandlers[h->fd];
+    slot.handler = h;
+    slot.mask = -1;
+    h->registered_with = this;
+        // the handler is asked at least once anyway
+    slot.polled = !h->tracks_interest;
+    if(slot.polled) {
+        slot.listpos = polledcount;
+        polledfds[polledcount++] = h->fd;
+    } else {
+        slot.listpos = dirtycount;
+        dirtyfds[dirtycount++] = h->fd;
+    }
 }
 
 void SUEEventSelector::RemoveFdHandler(SUEFdHandler *h) 
 {
-    // please note we shouldn't use the value of f->fd as
-    // the array's index because it can be invalid for some reasons
-    for(int i=0; i<fdhandlerssize; i++) {
-        if(fdhandlers[i] == h) {
-            fdhandlers[i] = 0;
+    int i = h->fd;
+    if(i < 0 || i >= fdhandlerssize || fdhandlers[i].handler != h) {
+        // the value of h->fd can be invalid for some reasons, 
+        // so we have to search for the handler
+        for(i=0; i<fdhandlerssize; i++)
+            if(fdhandlers[i].handler == h) 
+                break;
+        if(i >= fdhandlerssize) 
             return;
-        }
     }
+    DropFromFdLists(i);
+    h->registered_with = 0;
+    fdhandlers[i].handler = 0;
+    if(selectsets) {
+        FD_CLR(i, &selectsets->readfds);
+        FD_CLR(i, &selectsets->writefds);
+        FD_CLR(i, &selectsets->exceptfds);
+    }
+#ifdef SUE_HAVE_EPOLL
+    if(fdhandlers[i].mask != -1) {
+        // the descriptor might be already closed, in which
+        // case the kernel has already forgotten it
+        epoll_event ev;
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, i, &ev);
+    }
+#endif
+    fdhandlers[i].mask = -1;
+    if(fdhandlers[i].readypos != -1) {
+        readylist[fdhandlers[i].readypos].handler = 0;
+        fdhandlers[i].readypos = -1;
+    }
+}
+
+void SUEEventSelector::InterestChanged(SUEFdHandler *h)
+{
+    int fd = h->fd;
+    if(fd < 0 || fd >= fdhandlerssize || fdhandlers[fd].handler != h)
+        return;
+    FdHandlerSlot &slot = fdhandlers[fd];
+    if(slot.listpos != -1)  // polled, or already marked
+        return;
+    slot.listpos = dirtycount;
+    dirtyfds[dirtycount++] = fd;
+}
+
+void SUEEventSelector::DropFromFdLists(int fd)
+{
+    FdHandlerSlot &slot = fdhandlers[fd];
+    if(slot.listpos == -1)
+        return;
+    int *list = slot.polled ? polledfds : dirtyfds;
+    int &count = slot.polled ? polledcount : dirtycount;
+    count--;
+    if(slot.listpos != count) {
+        list[slot.listpos] = list[count];
+        fdhandlers[list[count]].listpos = slot.listpos;
+    }
+    slot.listpos = -1;
 }
 
 void SUEEventSelector::RegisterTimeoutHandler(SUETimeoutHandler *h)
 {
-    TimeoutsListItem *tmp = new TimeoutsListItem;
-    tmp->handler = h;
-    if(!timeouts) {
-        tmp->next = 0;
-        timeouts = tmp;  
-    } else {
-        TimeoutsListItem **tmp2 = &timeouts;  
-        while (*tmp2 && *((*tmp2)->handler) < *h) {
-            tmp2 = &((*tmp2)->next);
-        }
-        if(!(*tmp2)) {
-            *tmp2 = tmp;
-            tmp->next = 0;
-        } else {
-            if((*tmp2)->handler == h) { // it is the SAME object
-              delete tmp;
-              return; 
-            }
-            tmp->next = *tmp2;
-            *tmp2 = tmp;
-        }
+    int idx = h->heapindex;
+    if(idx != -1) { // it is the SAME object, just move it
+        timeouts[idx].sec = h->sec;
+        timeouts[idx].usec = h->usec;
+        TimeoutsSiftUp(idx);
+        TimeoutsSiftDown(h->heapindex);
+        return;
     }
+    if(timeoutscount >= timeoutssize) {
+        TimeoutsHeapItem *old = timeouts;
+        timeouts = new TimeoutsHeapItem [timeoutssize *= 2];
+        for(int i=0; i<timeoutscount; i++) 
+            timeouts[i] = old[i];
+        delete [] old;
+    }
+    idx = timeoutscount++;
+    timeouts[idx].sec = h->sec;
+    timeouts[idx].usec = h->usec;
+    timeouts[idx].handler = h;
+    h->heapindex = idx;
+    TimeoutsSiftUp(idx);
 }
 
 void SUEEventSelector::RemoveTimeoutHandler(SUETimeoutHandler *h)
 {
-    TimeoutsListItem **tmp = &timeouts;  
-    while(*tmp && (*tmp)->handler != h) {
-        tmp = &((*tmp)->next);
+    if(h->heapindex == -1) 
+        return;
+    TimeoutsRemoveAt(h->heapindex);
+}
+
+void SUEEventSelector::RearmTimeoutHandler(SUETimeoutHandler *h)
+{
+    int idx = h->heapindex;
+    if(idx == -1) {
+        RegisterTimeoutHandler(h);
+        return;
     }
-    if(*tmp) {
-        TimeoutsListItem *tmp2 = *tmp;
-        *tmp = (*tmp)->next; 
-        delete tmp2;
+    if(h->IsBefore(timeouts[idx].sec, timeouts[idx].usec)) {
+        timeouts[idx].sec = h->sec;
+        timeouts[idx].usec = h->usec;
+        TimeoutsSiftUp(idx);
+    }
+    // otherwise, HandleTimeouts() will take care
+}
+
+static inline bool heap_item_less(long s1, long u1, long s2, long u2)
+{
+    return (s1 < s2) || (s1 == s2 && u1 < u2);
+}
+
+void SUEEventSelector::TimeoutsSiftUp(int idx)
+{
+    TimeoutsHeapItem item = timeouts[idx];
+    while(idx > 0) {
+        int parent = (idx - 1) / 4;
+        if(!heap_item_less(item.sec, item.usec, 
+                           timeouts[parent].sec, timeouts[parent].usec))
+            break;
+        timeouts[idx] = timeouts[parent];
+        timeouts[idx].handler->heapindex = idx;
+        idx = parent;
+    }
+    timeouts[idx] = item;
+    item.handler->heapindex = idx;
+}
+
+void SUEEventSelector::TimeoutsSiftDown(int idx)
+{
+    TimeoutsHeapItem item = timeouts[idx];
+    for(;;) {
+        int child = idx * 4 + 1;
+        if(child >= timeoutscount) 
+            break;
+        int lim = child + 4 < timeoutscount ? child + 4 : timeoutscount;
+        int best = child;
+        for(int i = child + 1; i < lim; i++) {
+            if(heap_item_less(timeouts[i].sec, timeouts[i].usec,
+                              timeouts[best].sec, timeouts[best].usec))
+                best = i;
+        }
+        if(!heap_item_less(timeouts[best].sec, timeouts[best].usec,
+                           item.sec, item.usec))
+            break;
+        timeouts[idx] = timeouts[best];
+        timeouts[idx].handler->heapindex = idx;
+        idx = best;
     }
+    timeouts[idx] = item;
+    item.handler->heapindex = idx;
+}
+
+void SUEEventSelector::TimeoutsRemoveAt(int idx)
+{
+    timeouts[idx].handler->heapindex = -1;
+    timeoutscount--;
+    if(idx == timeoutscount) 
+        return;
+    timeouts[idx] = timeouts[timeoutscount];
+    timeouts[idx].handler->heapindex = idx;
+    TimeoutsSiftUp(idx);
+    TimeoutsSiftDown(timeouts[idx].handler->heapindex);
 }
 
 void SUEEventSelector::RegisterSignalHandler(SUESignalHandler *h)
@@ -253,6 +719,11 @@ void SUEEventSelector::RegisterSignalHandler(SUESignalHandler *h)
     tmp->next = signalhandlers;
     signalhandlers = tmp;
     TheSignalQueue.Add(tmp->handler->signo);
+    if(!signalfdhandler) {
+        signalfdhandler = 
+            new SUESignalFdHandler(this, TheSignalQueue.GetFd());
+        RegisterFdHandler(signalfdhandler);
+    }
 }
 
 void SUEEventSelector::RemoveSignalHandler(SUESignalHandler *h)
@@ -271,6 +742,11 @@ void SUEEventSelector::RemoveSignalHandler(SUESignalHandler *h)
         if(p->handler->signo==signo) return; // another one exists
     // else, remove it
     TheSignalQueue.Remove(signo);
+    if(!signalhandlers && signalfdhandler) {
+        RemoveFdHandler(signalfdhandler);
+        delete signalfdhandler;
+        signalfdhandler = 0;
+    }
 }
 
 void SUEEventSelector::RegisterLoopHook(SUELoopHook *h)
@@ -293,15 +769,29 @@ void SUEEventSelector::RemoveLoopHook(SUELoopHook *h)
     }
 }
  
+void SUEEventSelector::UpdateCurrentTime()
+{
+    read_clock(now_sec, now_usec);
+}
+
 struct timeval* SUEEventSelector::ComputeClosestTimeout(struct timeval &timeout)
 {
-    struct timeval current;
-    int rc = gettimeofday(&current, 0 /* timezone unused */);
-    if(rc != 0) 
-        throw SUEException("gettimeofday failed");
-    if(timeouts) {
-        timeout.tv_sec = timeouts->handler->sec - current.tv_sec;
-        timeout.tv_usec = timeouts->handler->usec - current.tv_usec;
+    if(taskscount > 0) {
+        // some tasks are left from the previous iteration
+        timeout.tv_sec = 0; timeout.tv_usec = 0;
+        return &timeout;
+    }
+    if(uring && uring->HasWaiting()) {
+        // the ring's submission queue was full; retry soon, but don't
+        // spin while the kernel is short of resources
+        timeout.tv_sec = 0; timeout.tv_usec = 1000;
+        return &timeout;
+    }
+    if(timeoutscount > 0) {
+        // the handlers might take some time since we woke up
+        UpdateCurrentTime();
+        timeout.tv_sec = timeouts[0].sec - now_sec;
+        timeout.tv_usec = timeouts[0].usec - now_usec;
         while(timeout.tv_usec < 0) {
             timeout.tv_usec += 1000000;
             timeout.tv_sec -= 1;
@@ -321,30 +811,75 @@ struct timeval* SUEEventSelector::ComputeClosestTimeout(struct timeval &timeout)
     }   
 }
 
-struct SelectDescriptorsSet {
-    fd_set readfds;
-    fd_set writefds;
-    fd_set exceptfds;
-};
-
 void SUEEventSelector::SetupFdSets(SelectDescriptorsSet &d)
 {
-    FD_ZERO(&d.readfds);
-    FD_ZERO(&d.writefds);
-    FD_ZERO(&d.exceptfds);
-    for(int i=0; i<fdhandlerssize; i++) {
-        if(fdhandlers[i]) {
-            if(fdhandlers[i]->WantRead()) FD_SET(i, &d.readfds);
-            if(fdhandlers[i]->WantWrite()) FD_SET(i, &d.writefds);
-            if(fdhandlers[i]->WantExcept()) FD_SET(i, &d.exceptfds);
-        }
+    UpdateInterests();
+    d = *selectsets;
+}
+
+void SUEEventSelector::UpdateInterests()
+{
+    for(int i=0; i<polledcount; i++)
+        UpdateInterest(polledfds[i]);
+    while(dirtycount > 0) {
+        int fd = dirtyfds[--dirtycount];
+        fdhandlers[fd].listpos = -1;
+        UpdateInterest(fd);
     }
 }
 
+void SUEEventSelector::UpdateInterest(int fd)
+{
+    SUEFdHandler *h = fdhandlers[fd].handler;
+    bool r = h->WantRead(), w = h->WantWrite(), ex = h->WantExcept();
+    if(selectsets) {
+        if(r) FD_SET(fd, &selectsets->readfds);
+        else FD_CLR(fd, &selectsets->readfds);
+        if(w) FD_SET(fd, &selectsets->writefds);
+        else FD_CLR(fd, &selectsets->writefds);
+        if(ex) FD_SET(fd, &selectsets->exceptfds);
+        else FD_CLR(fd, &selectsets->exceptfds);
+        return;
+    }
+#ifdef SUE_HAVE_EPOLL
+    int mask = 0;
+    if(r) mask |= EPOLLIN;
+    if(w) mask |= EPOLLOUT;
+    if(ex) mask |= EPOLLPRI;
+    int current = fdhandlers[fd].mask;
+    if(mask == current || (mask == 0 && current == -1))
+        return;
+    epoll_event ev;
+    ev.events = mask;
+    ev.data.fd = fd;
+    int rc;
+    if(mask == 0) { 
+        // HUP and ERR are always reported, so we'd get them
+        // on every iteration; just don't watch the fd at all
+        rc = epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
+        fdhandlers[fd].mask = -1;
+    } else 
+    if(current == -1) {
+        rc = epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+        fdhandlers[fd].mask = mask;
+    } else {
+        rc = epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+        fdhandlers[fd].mask = mask;
+    }
+    if(rc == -1 && mask != 0)
+        throw SUEException("epoll_ctl failed");
+#endif
+}
+
 void SUEEventSelector::HandleSignals() 
 {
-    int signo;
-    while(TheSignalQueue.FetchSignalEvent(signo)) {
+    bool fired[NSIG];
+    for(int i=0; i<NSIG; i++) fired[i] = false;
+    if(!TheSignalQueue.FetchSignals(fired))
+        return;
+    for(int signo=1; signo<NSIG; signo++) {
+        if(!fired[signo])
+            continue;
         SignalListItem *sig = signalhandlers;
         while(sig) {
             if(sig->handler->signo == signo) 
@@ -354,68 +889,346 @@ void SUEEventSelector::HandleSignals()
     }
 }
 
+void SUEEventSelector::PostTask(SUETaskHandler *h, TaskPriority prio)
+{
+    if(h->IsQueued())
+        RemoveTask(h);
+    TaskQueue &q = taskqueues[prio];
+    h->priority = prio;
+    h->next = 0;
+    h->prev = q.last;
+    if(q.last)
+        q.last->next = h;
+    else
+        q.first = h;
+    q.last = h;
+    taskscount++;
+}
+
+void SUEEventSelector::RemoveTask(SUETaskHandler *h)
+{
+    if(!h->IsQueued())
+        return;
+    TaskQueue &q = taskqueues[h->priority];
+    if(h->prev)
+        h->prev->next = h->next;
+    else
+        q.first = h->next;
+    if(h->next)
+        h->next->prev = h->prev;
+    else
+        q.last = h->prev;
+    h->prev = h->next = 0;
+    h->priority = -1;
+    taskscount--;
+}
+
+void SUEEventSelector::RequestFlush(SUEFlushHandler *h)
+{
+    if(h->requested)
+        return;
+    h->requested = true;
+    h->prev = 0;
+    h->next = firstflush;
+    if(firstflush)
+        firstflush->prev = h;
+    firstflush = h;
+}
+
+void SUEEventSelector::CancelFlush(SUEFlushHandler *h)
+{
+    if(!h->requested)
+        return;
+    if(h->prev)
+        h->prev->next = h->next;
+    else
+        firstflush = h->next;
+    if(h->next)
+        h->next->prev = h->prev;
+    h->prev = h->next = 0;
+    h->requested = false;
+}
+
+void SUEEventSelector::HandleFlushes()
+{
+    while(firstflush) {
+        SUEFlushHandler *h = firstflush;
+        CancelFlush(h);
+        h->FlushHandle(); // this can delete h
+    }
+}
+
+void SUEEventSelector::HandleTasks()
+{
+    if(!taskscount)
+        return;
+    unsigned long long deadline = monotonic_ns() + taskbudget * 1000ULL;
+    while(taskscount > 0) {
+        int p = 0;
+        while(!taskqueues[p].first)
+            p++;
+        SUETaskHandler *h = taskqueues[p].first;
+        RemoveTask(h);
+#ifdef SUE_HAVE_STATS
+        unsigned long long start = stats_ticks();
+#endif
+        h->TaskHandle(); // this can delete h
+#ifdef SUE_HAVE_STATS
+        stats.tasks_run++;
+        stats.tasks_ns += stats_ticks() - start;
+#endif
+        if(monotonic_ns() >= deadline)
+            break;
+    }
+#ifdef SUE_HAVE_STATS
+    if(taskscount > 0)
+        stats.tasks_rolled_over++;
+#endif
+}
+
 void SUEEventSelector::HandleLoopHooks() 
 {
+#ifdef SUE_HAVE_STATS
+    if(!loophooks)
+        return;
+    unsigned long long start = stats_ticks();
+#endif
     for(LoopHookListItem *tmp = loophooks; tmp; tmp = tmp->next)
         tmp->hook->LoopHook();
+#ifdef SUE_HAVE_STATS
+    stats.hooks_ns += stats_ticks() - start;
+#endif
 }
 
-void SUEEventSelector::HandleFds(SelectDescriptorsSet &d)
+void SUEEventSelector::AddToReadyList(int fd, bool r, bool w, bool ex)
+{
+    if(readycount >= readylistsize) {
+        ReadyListItem *old = readylist;
+        readylist = new ReadyListItem [readylistsize *= 2];
+        for(int i=0; i<readycount; i++) 
+            readylist[i] = old[i];
+        delete [] old;
+    }
+    ReadyListItem &item = readylist[readycount];
+    item.handler = fdhandlers[fd].handler;
+    item.fd = fd;
+    item.r = r;
+    item.w = w;
+    item.ex = ex;
+    fdhandlers[fd].readypos = readycount;
+    readycount++;
+}
 
+void SUEEventSelector::CollectReadyFds(SelectDescriptorsSet &d, int count)
 {
-    for(int i=0; i<fdhandlerssize; i++) {
-        if(fdhandlers[i]&&(FD_ISSET(i, &d.readfds)||
-                           FD_ISSET(i, &d.writefds)||
-                           FD_ISSET(i, &d.exceptfds)
-                          )
-        ) {
-             fdhandlers[i]->FdHandle(FD_ISSET(i, &d.readfds),  
-                                     FD_ISSET(i, &d.writefds),
-                                     FD_ISSET(i, &d.exceptfds));
-        }
+    // select(2) told us how many bits are set, so we can stop as soon 
+    // as all of them are found
+    for(int i=0; i<fdhandlerssize && count > 0; i++) {
+        bool r = FD_ISSET(i, &d.readfds);
+        bool w = FD_ISSET(i, &d.writefds);
+        bool ex = FD_ISSET(i, &d.exceptfds);
+        if(!(r || w || ex)) 
+            continue;
+        count -= r + w + ex;
+        if(fdhandlers[i].handler) 
+            AddToReadyList(i, r, w, ex);
     } 
 }
 
-void SUEEventSelector::HandleTimeouts(struct timeval &current) 
+void SUEEventSelector::CollectEpollEvents(int count)
 {
-    while(timeouts &&
-          timeouts->handler->IsBefore(current.tv_sec, current.tv_usec))
+#ifdef SUE_HAVE_EPOLL
+    for(int i=0; i<count; i++) {
+        int fd = epollevents[i].data.fd;
+        if(fd >= fdhandlerssize || !fdhandlers[fd].handler) 
+            continue;
+        int mask = fdhandlers[fd].mask;
+        if(mask == -1) 
+            continue;
+        unsigned int ev = epollevents[i].events;
+        // select(2) reports hangups and errors as readability
+        // and/or writability, so do we
+        if(ev & (EPOLLHUP|EPOLLERR)) 
+            ev |= mask & (EPOLLIN|EPOLLOUT);
+        ev &= mask;
+        if(!ev)
+            continue;
+        AddToReadyList(fd, ev & EPOLLIN, ev & EPOLLOUT, ev & EPOLLPRI);
+    }
+#endif
+}
+
+void SUEEventSelector::ClearReadyList()
+{
+    for(int i=0; i<readycount; i++) 
+        if(readylist[i].handler)
+            fdhandlers[readylist[i].fd].readypos = -1;
+    readycount = 0;
+}
+
+void SUEEventSelector::HandleFds()
+{
+    // handlers may remove each other (see RemoveFdHandler()), in which
+    // case the item's handler is zeroed
+    for(int i=0; i<readycount; i++) {
+        SUEFdHandler *h = readylist[i].handler;
+        if(!h) 
+            continue;
+        readylist[i].handler = 0;
+        fdhandlers[readylist[i].fd].readypos = -1;
+#ifdef SUE_HAVE_STATS
+          // the handler may delete itself, so look the class up first
+        SUESelectorStats::HandlerClass *cls = StatsClass(typeid(*h).name());
+        unsigned long long start = stats_ticks();
+#endif
+        h->FdHandle(readylist[i].r, readylist[i].w, readylist[i].ex);
+#ifdef SUE_HAVE_STATS
+        unsigned long long spent = stats_ticks() - start;
+        cls->calls++;
+        cls->total_ns += spent;
+        if(spent > cls->max_ns)
+            cls->max_ns = spent;
+#endif
+    }
+    readycount = 0;
+}
+
+void SUEEventSelector::HandleTimeouts() 
+{
+#ifdef SUE_HAVE_STATS
+    int fired = 0;
+#endif
+    while(timeoutscount > 0 &&
+          heap_item_less(timeouts[0].sec, timeouts[0].usec,
+                         now_sec, now_usec))
     {
-        SUETimeoutHandler *hdl = timeouts->handler;
-        TimeoutsListItem *tmp = timeouts;
-        timeouts = timeouts->next;
-        delete tmp;
+        SUETimeoutHandler *hdl = timeouts[0].handler;
+        if(!hdl->IsBefore(now_sec, now_usec)) {
+            // the timeout was postponed by RearmTimeoutHandler()
+            timeouts[0].sec = hdl->sec;
+            timeouts[0].usec = hdl->usec;
+            TimeoutsSiftDown(0);
+            continue;
+        }
+        TimeoutsRemoveAt(0);
+#ifdef SUE_HAVE_STATS
+        fired++;
+        SUESelectorStats::HandlerClass *cls = StatsClass(typeid(*hdl).name());
+        unsigned long long start = stats_ticks();
+#endif
         hdl->TimeoutHandle(); // In some cases this can delete hdl ! 
+#ifdef SUE_HAVE_STATS
+        unsigned long long spent = stats_ticks() - start;
+        cls->calls++;
+        cls->total_ns += spent;
+        if(spent > cls->max_ns)
+            cls->max_ns = spent;
+#endif
     }
+#ifdef SUE_HAVE_STATS
+    stats.timeouts_fired += fired;
+    stats.timeouts_hist[stats_bucket(fired)]++;
+#endif
 }
 
+#ifdef SUE_HAVE_TLS
+  // makes the_running_selector right even if Go() throws
+class SUERunningSelectorGuard {
+    const SUEEventSelector *saved;
+public:
+    SUERunningSelectorGuard(const SUEEventSelector *sel)
+        { saved = the_running_selector; the_running_selector = sel; }
+    ~SUERunningSelectorGuard() { the_running_selector = saved; }
+};
+#endif
+
 void SUEEventSelector::Go()  
 {
+#ifdef SUE_HAVE_TLS
+    SUERunningSelectorGuard guard(this);
+#endif
+    UpdateCurrentTime();
     breakflag = false;
     do {
         SelectDescriptorsSet d;    
-        SetupFdSets(d);
+        int rc = 0;
         struct timeval timeout;
-        struct timeval *pt = ComputeClosestTimeout(timeout); 
-        /////////////////////////////////////////////////////////////////////
-        int rc = 
-        select(fdhandlerssize, &d.readfds, &d.writefds, &d.exceptfds, pt);
-        /////////////////////////////////////////////////////////////////////
+        struct timeval *pt;
+#ifdef SUE_HAVE_STATS
+        unsigned long long iter_start = monotonic_ns(), wait_start = 0;
+#endif
+        // Output produced by the previous iteration goes first
+        HandleFlushes();
+        if(uring)
+            uring->Flush();
+        if(epollfd == -1) {
+            SetupFdSets(d);
+            pt = ComputeClosestTimeout(timeout); 
+#ifdef SUE_HAVE_STATS
+            wait_start = monotonic_ns();
+#endif
+            /////////////////////////////////////////////////////////////////
+            rc = select(fdhandlerssize, 
+                        &d.readfds, &d.writefds, &d.exceptfds, pt);
+            /////////////////////////////////////////////////////////////////
+        } else {
+#ifdef SUE_HAVE_EPOLL
+            UpdateInterests();
+            pt = ComputeClosestTimeout(timeout); 
+            // round up, or else we'd spin until the timeout comes
+            int ms = -1;
+            if(pt) {
+                ms = pt->tv_sec < 1000000 ? 
+                    pt->tv_sec * 1000 + (pt->tv_usec + 999) / 1000 :
+                    1000000000;
+            }
+#ifdef SUE_HAVE_STATS
+            wait_start = monotonic_ns();
+#endif
+            /////////////////////////////////////////////////////////////////
+            rc = epoll_wait(epollfd, epollevents, 
+                            SUE_EPOLL_EVENTS_PER_CALL, ms);
+            /////////////////////////////////////////////////////////////////
+#endif
+        }
         if(rc<0 && errno!=EINTR) {
             HandleSelectFailure(rc);
         }
-        // Remember the time select(2) returned
-        // we can't do it before that if because it could change errno
-        struct timeval current;
-        gettimeofday(&current, 0 /* timezone unused */);
-        HandleSignals();
+        // Remember the time select(2) returned; the handlers will
+        // all use this value.  We can't do it before that if because 
+        // it could change errno
+        UpdateCurrentTime();
+#ifdef SUE_HAVE_STATS
+        unsigned long long blocked = monotonic_ns() - wait_start;
+        stats.iterations++;
+        stats.blocked_ns += blocked;
+        stats.blocked_hist[stats_bucket(blocked / 1000)]++;
+#endif
         if(rc>0) { // file descriptors changed status
-            HandleFds(d);
+            // normally the list is empty here, but a handler could
+            // throw an exception last time
+            ClearReadyList();
+            if(epollfd == -1)
+                CollectReadyFds(d, rc);
+            else
+                CollectEpollEvents(rc);
+#ifdef SUE_HAVE_STATS
+            stats.ready_fds += readycount;
+            stats.ready_hist[stats_bucket(readycount)]++;
+#endif
+            HandleFds();
         }
         // Now handle the timeouts as of the select's return moment
-        HandleTimeouts(current);
+        HandleTimeouts();
+        // Then, the deferred tasks, as much as the budget allows
+        HandleTasks();
         // The last thing to do is call all main loop hooks
         HandleLoopHooks();
+#ifdef SUE_HAVE_STATS
+        unsigned long long busy = monotonic_ns() - iter_start - blocked;
+        if(busy > stats.longest_iteration_ns)
+            stats.longest_iteration_ns = busy;
+#endif
     } while(!breakflag);
 }
 
@@ -424,20 +1237,79 @@ void SUEEventSelector::Break()
     breakflag = true;  
 }
 
+void SUEEventSelector::GetStats(SUESelectorStats &a_stats) const
+{
+    a_stats = stats;
+#ifdef SUE_HAVE_STATS
+      // convert the callback times from ticks to nanoseconds
+    unsigned long long ticks = stats_ticks() - stats_ticks0;
+    unsigned long long ns = monotonic_ns() - stats_ns0;
+    double ratio = ticks ? (double)ns / (double)ticks : 1.0;
+    for(int i = 0; i < a_stats.classescount; i++) {
+        a_stats.classes[i].total_ns = 
+            (unsigned long long)(a_stats.classes[i].total_ns * ratio);
+        a_stats.classes[i].max_ns = 
+            (unsigned long long)(a_stats.classes[i].max_ns * ratio);
+    }
+    a_stats.hooks_ns = (unsigned long long)(a_stats.hooks_ns * ratio);
+    a_stats.tasks_ns = (unsigned long long)(a_stats.tasks_ns * ratio);
+#endif
+}
+
+void SUEEventSelector::ResetStats()
+{
+    memset(&stats, 0, sizeof(stats));
+#ifdef SUE_HAVE_STATS
+    stats.enabled = true;
+#endif
+    stats_ticks0 = stats_ticks();
+    stats_ns0 = monotonic_ns();
+}
+
+SUESelectorStats::HandlerClass *SUEEventSelector::StatsClass(const char *name)
+{
+    int i;
+    for(i = 0; i < stats.classescount; i++) {
+        if(stats.classes[i].name == name)
+            return stats.classes + i;
+    }
+    if(i < SUESelectorStats::max_classes - 1) {
+        stats.classescount++;
+        stats.classes[i].name = name;
+        return stats.classes + i;
+    }
+      // the last item is for all the rest
+    stats.classescount = SUESelectorStats::max_classes;
+    return stats.classes + SUESelectorStats::max_classes - 1;
+}
+
 void SUEEventSelector::ResizeFdHandlers(int newsize)
 {
     int oldsize = fdhandlerssize;
-    SUEFdHandler** oldhandlers = fdhandlers;
+    FdHandlerSlot* oldhandlers = fdhandlers;
     if(newsize <= fdhandlerssize) { // can't shrink!
         throw SUEException("attempt to shrink fd array");
     }
-    fdhandlers = new SUEFdHandler* [fdhandlerssize = newsize];
+    fdhandlers = new FdHandlerSlot [fdhandlerssize = newsize];
     int i;
     for(i=0; i<oldsize; i++) 
         fdhandlers[i] = oldhandlers[i];
-    for(; i<newsize; i++)
-        fdhandlers[i] = 0;
+    for(; i<newsize; i++) {
+        fdhandlers[i].handler = 0;
+        fdhandlers[i].mask = -1;
+        fdhandlers[i].readypos = -1;
+        fdhandlers[i].listpos = -1;
+    }
     delete [] oldhandlers;
+        // each descriptor is in one of the lists at most
+    int *oldpolled = polledfds;
+    polledfds = new int[newsize];
+    memcpy(polledfds, oldpolled, polledcount * sizeof(int));
+    delete [] oldpolled;
+    int *olddirty = dirtyfds;
+    dirtyfds = new int[newsize];
+    memcpy(dirtyfds, olddirty, dirtycount * sizeof(int));
+    delete [] olddirty;
 }
 
 
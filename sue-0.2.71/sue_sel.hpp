@@ -28,10 +28,68 @@
      - SUETimeoutHandler
      - SUESignalHandler
      - SUELoopHook
+     - SUETaskHandler
      - SUEException
     These classes are likely needed in almost any event-driven application
  */
 
+//! Statistics of the main loop
+/*! A snapshot of the counters the selector maintains, see
+    SUEEventSelector::GetStats().  Times are in nanoseconds.  Histograms
+    are logarithmic: the bucket 0 counts zero values, and the bucket i
+    counts values from 2^(i-1) to 2^i-1; the last bucket counts all the
+    values which don't fit.
+    \note The counters are only maintained if the library is built 
+    without SUE_NO_STATS defined; otherwise, the instrumentation code 
+    is not compiled at all, and the snapshot is always empty.
+ */
+struct SUESelectorStats {
+    enum { 
+        histogram_size = 24, //!< buckets in every histogram
+        max_classes = 32     //!< handler classes counted separately
+    };
+       //! Callback statistics of handlers of the same class
+    struct HandlerClass {
+           //! Name of the class, as std::type_info::name() returns it
+           /*! The last item, if the table overflows, has 0 here and
+               accounts for all the classes which didn't fit.
+            */
+        const char *name;
+        unsigned long long calls;    //!< callbacks made
+        unsigned long long total_ns; //!< time spent within them
+        unsigned long long max_ns;   //!< the longest one
+    };
+
+    bool enabled;                    //!< are the counters maintained
+    unsigned long long iterations;   //!< iterations of the main loop
+       //! Time spent waiting in select(2) or epoll_wait(2)
+    unsigned long long blocked_ns;
+       //! Waits, by their length in microseconds
+    unsigned long long blocked_hist[histogram_size];
+       //! Descriptors reported ready, in total
+    unsigned long long ready_fds;
+       //! Wakeups, by the number of ready descriptors 
+    unsigned long long ready_hist[histogram_size];
+       //! Timeouts handled, in total
+    unsigned long long timeouts_fired;
+       //! Iterations, by the number of timeouts handled
+    unsigned long long timeouts_hist[histogram_size];
+       //! Time spent in the loop hooks
+    unsigned long long hooks_ns;
+       //! The longest iteration, not counting the wait
+    unsigned long long longest_iteration_ns;
+       //! Deferred tasks run (see SUEEventSelector::PostTask())
+    unsigned long long tasks_run;
+       //! Time spent running them
+    unsigned long long tasks_ns;
+       //! Iterations which left some tasks for the next ones
+    unsigned long long tasks_rolled_over;
+       //! Callbacks of file descriptor and timeout handlers
+    HandlerClass classes[max_classes];
+       //! Count of the items used in classes
+    int classescount;
+};
+
 //! Event selector
 /*! This class provides an object-oriented framework for the unix select(2)
     system call. It uses objects of:
@@ -56,31 +114,141 @@
       sets of handlers somewhere outside of the class (e.g., for debugging
       purposes), or if you want to handle select(2) failures specifically
       via overriding the HandleSelectFailure() method. 
+    \note On Linux, the selector uses epoll(7) instead of select(2) by
+      default, so the number of descriptors is not limited by FD_SETSIZE
+      and the cost of an iteration depends on the number of descriptors
+      which actually changed their state.  The backend can be chosen
+      with the constructor's argument; define SUE_NO_EPOLL when building
+      the library to disable the epoll(7) support at all.
  */
 class SUEEventSelector {
-         //! Timeouts queue (sorted by time, earlier first)
-    struct TimeoutsListItem {
-        TimeoutsListItem *next;
+public:
+       //! Priorities of deferred tasks, see PostTask()
+    enum TaskPriority {
+        task_high,
+        task_normal,
+        task_low,
+        task_priorities  //!< the count of the priorities
+    };
+private:
+         //! Timeouts queue item
+         /*! The moment is copied here from the handler so that the
+             handler's value may be moved later without touching 
+             the queue (see RearmTimeoutHandler()).  
+          */
+    struct TimeoutsHeapItem {
+        long sec;
+        long usec;
         class SUETimeoutHandler *handler; 
-    } *timeouts;
+    };
+         //! Timeouts queue 
+         /*! This is a 4-ary heap ordered by time, the earliest moment 
+             is always at index 0.  Every registered handler knows its
+             position within the heap, so removal doesn't need search.
+          */
+    TimeoutsHeapItem *timeouts;
+         //! Count of registered timeouts
+    int timeoutscount;
+         //! Current size of the timeouts array
+    int timeoutssize;
          //! Signal wanters list
     struct SignalListItem {
         SignalListItem *next;
         class SUESignalHandler *handler;
     } *signalhandlers;
+         //! Watches the descriptor signals are delivered through
+         /*! Registered as long as there are signal handlers */
+    class SUESignalFdHandler *signalfdhandler;
+         //! io_uring engine for duplex sessions, or 0 if not used
+    class SUEUring *uring;
+      //! Memory for the session buffers, created when first asked for
+    class SUEBufferPool *bufferpool;
+         //! The moment the selector woke up last time
+         /*! Measured on the CLOCK_MONOTONIC scale, see GetCurrentTime()
+          */
+    long now_sec, now_usec;
+         //! The counters, see GetStats() 
+         /*! The times are kept in the units of the cheapest clock 
+             available (e.g., TSC ticks) and converted on snapshot.
+          */
+    SUESelectorStats stats;
+         //! The stats clock and CLOCK_MONOTONIC (ns) at the same moment
+    unsigned long long stats_ticks0, stats_ns0;
+    friend class SUESignalFdHandler;
+         //! File descriptor handler slot
+    struct FdHandlerSlot {
+        class SUEFdHandler *handler;
+            //! Events currently requested from the kernel
+            /*! Only used by the epoll backend; -1 means the 
+                descriptor is not added to the epoll set.
+             */
+        int mask;
+            //! Index in the ready list, -1 if the fd is not there
+        int readypos;
+            //! Index in the polled or in the dirty list, or -1
+            /*! A handler which doesn't track its interest is always 
+                in the polled list; one which does is in the dirty 
+                list while its interest is to be re-evaluated.
+             */
+        int listpos;
+            //! Is the handler in the polled list (rather than dirty)?
+        bool polled;
+    };
          //! File descriptor handlers 
          /*! Array indexed by descriptor values themselves.
-             That is, fdhandlers[3] is a pointer to the FdHandler
+             That is, fdhandlers[3].handler is a pointer to the FdHandler
              for fd=3, if any, or NULL. Array is resized as necessary.
           */
-    class SUEFdHandler** fdhandlers;
+    FdHandlerSlot* fdhandlers;
          //! Current size of the fdhandlers array
     int fdhandlerssize;
+         //! Descriptors whose interest is asked for on every iteration
+    int *polledfds;
+    int polledcount;
+         //! Descriptors whose interest is to be asked for once
+    int *dirtyfds;
+    int dirtycount;
+         //! The descriptor sets for select(2), kept up to date
+         /*! Only used by the select backend; copied before each call.
+          */
+    struct SelectDescriptorsSet *selectsets;
+         //! The epoll(7) descriptor, or -1 if select(2) is used
+    int epollfd;
+         //! Buffer for epoll_wait(2) results
+    struct epoll_event *epollevents;
+         //! Descriptor which is ready for I/O
+    struct ReadyListItem {
+            //! The handler to call, NULL if it is removed meanwhile
+        class SUEFdHandler *handler;
+        int fd;
+        bool r, w, ex;
+    };
+         //! Ready list
+         /*! This array is filled after select(2) or epoll_wait(2)
+             returns, with descriptors which changed their state, 
+             so that dispatching doesn't depend on the total number
+             of descriptors.
+          */
+    ReadyListItem *readylist;
+         //! Count of items in the ready list
+    int readycount;
+         //! Current size of the readylist array
+    int readylistsize;
          //! List of loop hooks
     struct LoopHookListItem {
         LoopHookListItem *next;
         class SUELoopHook *hook; 
     } *loophooks;
+         //! Queues of deferred tasks, one per priority
+    struct TaskQueue {
+        class SUETaskHandler *first, *last;
+    } taskqueues[task_priorities];
+         //! Count of the queued tasks
+    int taskscount;
+         //! Time (microseconds) tasks may take per iteration
+    long taskbudget;
+         //! Handlers to be flushed before the next wait
+    class SUEFlushHandler *firstflush;
          //! Is it time to break the main loop?
          /*! This flag is cleared by Go() function and may be set by
              Break() function. Go() checks the flag after all the 
@@ -92,9 +260,28 @@ private:
          //! Resize (enlarge) the fdhandlers array
     void ResizeFdHandlers(int newsize);
 public:
+       //! Backends the selector is able to use
+    enum Backend {
+        backend_default, //!< epoll(7) where available, select(2) otherwise
+        backend_select,  //!< select(2)
+        backend_epoll,   //!< epoll(7), falls back to select(2) on failure
+           //! epoll(7), plus io_uring(7) for duplex sessions
+           /*! If io_uring is not available, this is the same as
+               backend_epoll.  See SUEUring.
+            */
+        backend_uring
+    };
        //! Constructor
-    SUEEventSelector();
+       /*! \param a_backend chooses the system call used to wait
+           for events.  Regardless of the backend, all the handlers
+           are used the same way.
+        */
+    SUEEventSelector(Backend a_backend = backend_default);
        //! Destructor
+       /*! The handlers still registered are not touched: they may have
+           been destroyed already, which is the normal order for the
+           objects created after the selector.
+        */
     virtual ~SUEEventSelector();
        //! Register file descriptor handler
        /*! Registers an FD to be watched. FD is specified with a 
@@ -109,9 +296,23 @@ public:
     void RegisterFdHandler(SUEFdHandler *h);
        //! Removes the specified handler
        /*! Removes (unregisters) an FD handler. In case the handler is
-           not registered, silently ignores the call
+           not registered, silently ignores the call.
+           \note The handler is found by its descriptor value, so the
+           operation takes constant time.  If the descriptor was
+           changed after the registration, all the registered handlers
+           are scanned.
+           \note It is safe to remove any handler from within any other
+           handler; if the removed one is ready in the current iteration,
+           it will not be called.
         */
     void RemoveFdHandler(SUEFdHandler *h);
+       //! Re-evaluate the handler's interest before the next wait
+       /*! Only makes sense for the handlers which track their 
+           interest (see SUEFdHandler::TrackInterest()); the rest are 
+           asked on every iteration anyway.  The call is cheap and 
+           may be repeated; the handler is asked only once.
+        */
+    void InterestChanged(SUEFdHandler *h);
        
        //! Register a timeout handler
        /*! Registers a time moment at which to wake up and call the 
@@ -123,10 +324,12 @@ public:
            either the moment comes and notification function is called
            OR it is explicitly unregistered with RemoveTimeoutHandler
            method.
+           \note Registering an already registered handler once again
+           just moves it to the new moment.
            \warning It is assumed that the value of the timeout doesn't
-           change when it is registered. Changind it will lead to 
-           unpredictable behaviour. If you need to change thee timeout, 
-           then first unregister it, then change and register again.
+           change when it is registered. If you need to change the 
+           timeout, then either call RearmTimeoutHandler() after the
+           change, or unregister it, change and register again.
         */
     void RegisterTimeoutHandler(SUETimeoutHandler *h);
        //! Removes the specified handler
@@ -134,10 +337,40 @@ public:
            not registered, silently ignores the call
         */
     void RemoveTimeoutHandler(SUETimeoutHandler *h);
+       //! Notify the selector the handler's moment has changed
+       /*! Call this method after you changed the value of a registered
+           timeout handler (with Set() or SetFromNow()).  If the handler
+           is not registered, it is registered.
+           \par
+           Postponing a registered timeout (which is what idle timeouts
+           do on every activity) is performed lazily and costs O(1): the
+           queue still holds the old moment, and when that moment comes,
+           the handler is simply moved to its actual moment instead of 
+           being notified.  Moving a timeout to an earlier moment costs 
+           O(log n).
+        */
+    void RearmTimeoutHandler(SUETimeoutHandler *h);
 
 
        //! Register a signal handler
-       /*! Registers a signal specified with SUESignalHandler object  
+       /*! Registers a signal specified with SUESignalHandler object.
+           \par
+           Signals are delivered through a file descriptor watched by
+           the selector just like any other, so the main loop wakes up 
+           immediately.  On Linux, signalfd(2) is used, which means the
+           handled signals are BLOCKED in the process.  The child 
+           processes get them unblocked right after fork(2), so the 
+           programs they exec see the signal mask we had before, and 
+           drop the descriptor inherited from the parent; signals 
+           registered in the child get a descriptor of its own.  
+           Elsewhere, an asynchronous handler writes to a pipe (the 
+           self-pipe trick).
+           \note Several occurences of the same signal which come before
+           the selector gets to them are coalesced into one call of
+           SignalHandle().
+           \note All signal handlers should be registered with the same
+           selector; otherwise, a selector may consume signals other 
+           selectors' handlers wait for.
         */
     void RegisterSignalHandler(SUESignalHandler *h);
        //! Remove a signal handler
@@ -147,19 +380,59 @@ public:
     void RegisterLoopHook(SUELoopHook *h);
        //! Remove a signal handler
     void RemoveLoopHook(SUELoopHook *h);
+
+       //! Queue a deferred task
+       /*! The task is run once, after the descriptors and the timeouts 
+           are handled, either within the current iteration of the main
+           loop or within one of the next ones.  Tasks of a higher 
+           priority run first; tasks of the same priority run in the 
+           order they are posted.  If the task is queued already, it is
+           moved to the end of the appropriate queue.
+           \par
+           Tasks run one by one until the queues are empty or the time 
+           budget of the iteration (see SetTaskBudget()) is spent; the 
+           rest is left for the next iteration, which doesn't wait for
+           events then.  So, a long job split into slices, each of them
+           posting the next one, doesn't delay handling of the I/O for 
+           more than the budget.
+        */
+    void PostTask(SUETaskHandler *h, TaskPriority prio = task_normal);
+       //! Remove the task from the queue
+       /*! In case the task is not queued, silently ignores the call */
+    void RemoveTask(SUETaskHandler *h);
+       //! Set how long (in microseconds) tasks may run per iteration
+       /*! At least one task runs per iteration anyway.  */
+    void SetTaskBudget(long a_usec) { taskbudget = a_usec; }
+
+       //! Have the handler called before the selector waits again
+       /*! Flush handlers are called at the beginning of each iteration 
+           of the main loop, that is, after all the handlers of the 
+           previous iteration are done, but before the descriptor 
+           handlers are asked what they want.  So, a session may write
+           all it has produced during the iteration with a single system
+           call, without waiting for the descriptor to be reported as
+           writable.  Flushes requested by the flush handlers themselves
+           are done at the same stage.
+           \note Requesting a flush for a handler which is already 
+           waiting for it does nothing.
+        */
+    void RequestFlush(SUEFlushHandler *h);
+       //! Don't call the handler
+       /*! In case the flush is not requested, silently ignores the call */
+    void CancelFlush(SUEFlushHandler *h);
 	
        //! Main loop
        /*! This function 
+            - calls the flush handlers (see RequestFlush())
             - sets up the fd_set's for read, write and except notifications
               in accordance to the set of registered file handlers
             - chooses the closest time event from the set of registered
               timeout handlers
-            - sets the signal handling functions as appropriate
             - calls select(2)
-            - checks if any handled signals happened
             - examines the fd_set's for FDs changed state and calls the
-              appropriate callback methods
-            - examines the timeouts list, selects those are now in 
+              appropriate callback methods (this includes delivery of 
+              the handled signals)
+            - examines the timeouts queue, selects those are now in 
               the past, removes each of them from the list of registered 
               objects and calls its notification method
             - checks for the loop breaking flag. If it is set, breaks the 
@@ -176,22 +449,66 @@ public:
            of actions is performed, before repeating it. 
         */
     void Break();
+
+       //! Get the current time
+       /*! Returns the moment the main loop woke up at, so all the
+           handlers called within the same iteration see the same time
+           and nobody needs to ask the kernel for it.  
+           \note The time is taken from the monotonic clock 
+           (CLOCK_MONOTONIC), so it has nothing to do with the calendar,
+           but it is not affected by the system time adjustments.  All
+           the timeouts (see SUETimeoutHandler) are on this scale.
+        */
+    void GetCurrentTime(long &a_sec, long &a_usec) const
+        { a_sec = now_sec; a_usec = now_usec; }
+
+       //! Take a snapshot of the main loop statistics
+       /*! The call is cheap enough to be made any time; it must be
+           made from the thread which runs the selector, though.
+        */
+    void GetStats(SUESelectorStats &a_stats) const;
+       //! Zero all the statistics counters
+    void ResetStats();
+
+       //! Is the epoll(7) backend in use?
+    bool UsesEpoll() const { return epollfd != -1; }
+       //! The io_uring engine, or 0 if the backend doesn't use it
+    class SUEUring *GetUring() const { return uring; }
+       //! The pool of memory for the buffers served by this selector
+       /*! See SUEBufferPool; the pool is created on the first call */
+    class SUEBufferPool *GetBufferPool();
 	
        //! Handle select(2) errors
-       /*! This method is called whenever select(2) returns negative
-           value.
+       /*! This method is called whenever select(2) (or epoll_wait(2),
+           if the epoll backend is used) returns negative value.
            \param rc is the value returned by select(2)
            \note override this method to handle the event yourself
         */
     virtual void HandleSelectFailure(int rc) {}
 private:
     // several private functions used to decomposite Go()
+    void UpdateCurrentTime();
     struct timeval* ComputeClosestTimeout(struct timeval &timeout);
     void SetupFdSets(struct SelectDescriptorsSet &);
+    void UpdateInterests();
+    void UpdateInterest(int fd);
+    void DropFromFdLists(int fd);
     void HandleSignals();
-    void HandleFds(struct SelectDescriptorsSet &);
-    void HandleTimeouts(struct timeval &current);
+    void CollectReadyFds(struct SelectDescriptorsSet &, int count);
+    void CollectEpollEvents(int count);
+    void AddToReadyList(int fd, bool r, bool w, bool ex);
+    void ClearReadyList();
+    void HandleFds();
+    void HandleTimeouts();
+    void HandleTasks();
+    void HandleFlushes();
     void HandleLoopHooks();
+    SUESelectorStats::HandlerClass *StatsClass(const char *name);
+
+    // the timeouts heap primitives
+    void TimeoutsSiftUp(int idx);
+    void TimeoutsSiftDown(int idx);
+    void TimeoutsRemoveAt(int idx);
 };
 
 //! File descriptor handler for SUEEventSelector
@@ -207,8 +524,28 @@ private:
 */
 class SUEFdHandler {
     friend class SUEEventSelector;
+      //! The selector the handler is registered with, if any
+    class SUEEventSelector *registered_with;
+      //! Does the handler report changes of its interest?
+    bool tracks_interest;
 protected:
     int fd;               //!< File descriptor to handle
+
+      //! Promise to report changes of the interest
+      /*! By default, the selector asks the handler what it wants
+          (see WantRead(), WantWrite() and WantExcept()) on every
+          iteration of the main loop.  A handler which calls this
+          method promises to call InterestChanged() whenever any of
+          these methods may start returning another value, so that 
+          the selector only asks the handlers which have changed.
+          \note This must be done BEFORE the handler is registered.
+       */
+    void TrackInterest() { tracks_interest = true; }
+      //! Tell the selector our interest has changed
+      /*! Does nothing unless the handler is registered.  See 
+          TrackInterest().
+       */
+    void InterestChanged();
 public:
       //! Constructor
       /*! Constructor of the class. 
@@ -272,14 +609,22 @@ public:
     \note The SUETimeoutHandler object remains registered unless the event
     happens and the notification is done OR it is unregistered explicitly. 
     \warning Changing the timeout value when the object is registered will
-    lead to unpredictable behaviour. 
+    lead to unpredictable behaviour unless you call 
+    SUEEventSelector::RearmTimeoutHandler() right after the change.
+    \note The moments are measured with the monotonic clock, just like
+    SUEEventSelector::GetCurrentTime() does; they are not seconds since 
+    the epoch.
  */
 class SUETimeoutHandler {
     friend class SUEEventSelector;
-       //! seconds since epoch when the timeout is to happen
+       //! seconds (on the monotonic clock) when the timeout is to happen
     long sec;  
        //! microseconds (in addition to sec)
     long usec;
+       //! How late (microseconds) the notification may come
+    long slack;
+       //! Position in the selector's queue, -1 if not registered
+    int heapindex;
 public:
       //! Constructor of a full form
       /*! This form of constructor allows to pass the actual moment 
@@ -301,24 +646,36 @@ public:
 
       //! Set the timeout in absolute time
       /*! Set the actual moment when we need to be notified. 
-          \param a_sec seconds since epoch when the timeout is to happen
+          \param a_sec seconds (on the monotonic clock) when the timeout 
+          is to happen
           \param a_usec microseconds (in addition to sec)
        */
     void Set(long a_sec, long a_usec);
 
       //! Set the timeout relative to the current time
       /*! Set the time interval after which the timeout is to happen.
-          The method actually calls gettimeofday(3) and adds the arguments
-          to the values returned.
+          The arguments are added to the current time, which is the 
+          time cached by the selector (see 
+          SUEEventSelector::GetCurrentTime()) when called from within 
+          a handler, or the clock's value otherwise.  The result is 
+          rounded up according to the slack, see SetSlack().
           \param a_sec - seconds
           \param a_usec - microseconds
        */
     void SetFromNow(long a_sec, long a_usec = 0);
 
+      //! Let the notification come a bit late
+      /*! SetFromNow() will round the moment up to a multiple of the 
+          given amount of microseconds, so the timeouts which fall 
+          into the same window all come at once, in a single wakeup. 
+          0 (the default) means the moment is exact.
+       */
+    void SetSlack(long a_usec) { slack = a_usec; }
+
       //! Read the value. Used primarily by SUEEventSelector
     void Get(long &a_sec, long &a_usec) const;
 
-      //! Read the value, call gettimeofday(3) and return the difference
+      //! Read the value and return the difference with the current time
     void GetRemainingTime(long &a_sec, long &a_usec) const;
 
       //! Compare two timevalues. Used primarily by SUEEventSelector
@@ -380,6 +737,53 @@ public:
 };
 
 
+//! Deferred task for SUEEventSelector
+/*! Unlike SUELoopHook, a task is run once per posting, see 
+    SUEEventSelector::PostTask().  The task is no longer queued when 
+    TaskHandle() is called, so the method may post the task again (e.g.,
+    to do the next slice of a long job) or even delete the object.
+    \warning it's the user's duty to make sure the object is no longer
+    queued before destroying it
+ */
+class SUETaskHandler {
+    friend class SUEEventSelector;
+    SUETaskHandler *prev, *next;
+       //! The queue the task is in, -1 if it is not queued
+    int priority;
+public:
+    SUETaskHandler() : prev(0), next(0), priority(-1) {}
+    virtual ~SUETaskHandler() {}
+
+        //! Is the task waiting to be run?
+    bool IsQueued() const { return priority != -1; }
+
+        //! This method is called when the task's turn comes
+    virtual void TaskHandle() = 0;
+};
+
+
+
+//! Flush handler for SUEEventSelector
+/*! See SUEEventSelector::RequestFlush().  The handler is no longer
+    waiting when FlushHandle() is called, so the method may request
+    the flush again or even delete the object.
+    \warning it's the user's duty to make sure the flush is no longer
+    requested before destroying the object
+ */
+class SUEFlushHandler {
+    friend class SUEEventSelector;
+    SUEFlushHandler *prev, *next;
+    bool requested;
+public:
+    SUEFlushHandler() : prev(0), next(0), requested(false) {}
+    virtual ~SUEFlushHandler() {}
+
+        //! Is the flush requested?
+    bool IsFlushRequested() const { return requested; }
+
+        //! This method is called when the flush is done
+    virtual void FlushHandle() = 0;
+};
 
 
 //! Exception
@@ -18,34 +18,188 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "sue_sess.hpp"
 
 
+#ifndef SUE_WRITEV_MAX
+#define SUE_WRITEV_MAX 64
+#endif
 
+  // limits for the size of a single read(2), adapted to the traffic
+#ifndef SUE_READ_SIZE_MIN
+#define SUE_READ_SIZE_MIN 1024
+#endif
+#ifndef SUE_READ_SIZE_MAX
+#define SUE_READ_SIZE_MAX 65536
+#endif
+
+  // how much a session may read before the others get their turn
+#ifndef SUE_READ_BUDGET
+#define SUE_READ_BUDGET 262144
+#endif
+
+
+
+
+#ifndef SUE_BUFFER_POOL_TRIM
+#define SUE_BUFFER_POOL_TRIM 5
+#endif
+
+  // the least block, and the least class of the pool
+#define SUE_BUFFER_MIN_BLOCK 512
+
+
+// SUEBufferPool
+
+SUEBufferPool::SUEBufferPool(SUEEventSelector *a_selector)
+{
+    the_selector = a_selector;
+    for(int i = 0; i < SUE_BUFFER_POOL_CLASSES; i++) {
+        classes[i].first = 0;
+        classes[i].count = classes[i].lowcount = 0;
+    }
+    idlebytes = 0;
+    trimscheduled = false;
+}
+
+SUEBufferPool::~SUEBufferPool()
+{
+    the_selector->RemoveTimeoutHandler(this);
+    for(int i = 0; i < SUE_BUFFER_POOL_CLASSES; i++) {
+        while(classes[i].first) {
+            FreeBlock *b = classes[i].first;
+            classes[i].first = b->next;
+            delete[] (char*)b;
+        }
+    }
+}
+
+  // -1 if blocks of the size are not pooled
+int SUEBufferPool::ClassOf(int size)
+{
+    int c = 0;
+    int blocksize = SUE_BUFFER_MIN_BLOCK;
+    while(blocksize < size) {
+        blocksize *= 2;
+        c++;
+    }
+    return c < SUE_BUFFER_POOL_CLASSES ? c : -1;
+}
+
+char *SUEBufferPool::Get(int size, int &got)
+{
+    got = SUE_BUFFER_MIN_BLOCK;
+    while(got < size) 
+        got *= 2;
+    int c = ClassOf(got);
+    if(c == -1)
+        return new char[got];
+    SizeClass &cl = classes[c];
+    if(!cl.first)
+        return new char[got];
+    FreeBlock *b = cl.first;
+    cl.first = b->next;
+    cl.count--;
+    if(cl.lowcount > cl.count)
+        cl.lowcount = cl.count;
+    idlebytes -= got;
+    return (char*)b;
+}
+
+void SUEBufferPool::Put(char *block, int size)
+{
+    int c = ClassOf(size);
+    if(c == -1 || size != (SUE_BUFFER_MIN_BLOCK << c)) {
+        delete[] block;
+        return;
+    }
+    FreeBlock *b = (FreeBlock*)block;
+    b->next = classes[c].first;
+    classes[c].first = b;
+    classes[c].count++;
+    idlebytes += size;
+    if(!trimscheduled) {
+        SetFromNow(SUE_BUFFER_POOL_TRIM, 0);
+        the_selector->RegisterTimeoutHandler(this);
+        trimscheduled = true;
+    }
+}
+
+void SUEBufferPool::TimeoutHandle()
+{
+    trimscheduled = false;
+    for(int i = 0; i < SUE_BUFFER_POOL_CLASSES; i++) {
+        SizeClass &cl = classes[i];
+          // these weren't needed since the last time
+        for(; cl.lowcount > 0; cl.lowcount--) {
+            FreeBlock *b = cl.first;
+            cl.first = b->next;
+            cl.count--;
+            idlebytes -= SUE_BUFFER_MIN_BLOCK << i;
+            delete[] (char*)b;
+        }
+        cl.lowcount = cl.count;
+        if(cl.count > 0 && !trimscheduled) {
+            SetFromNow(SUE_BUFFER_POOL_TRIM, 0);
+            the_selector->RegisterTimeoutHandler(this);
+            trimscheduled = true;
+        }
+    }
+}
+
+
+// SUEBuffer
 
 SUEBuffer::SUEBuffer()
 {
-    data = new char[maxlen = 512];
+    storage = 0;
+    maxlen = 0;
+    data = storage;
     datalen = 0;
+    consumed = 0;
+    watcher = 0;
+    watchlimit = -1;
+    scanned = 0;
+    pool = 0;
 }
 
 SUEBuffer::~SUEBuffer()
 {
-    delete[] data;
+    if(storage)
+        FreeStorage();
+}
+
+void SUEBuffer::FreeStorage()
+{
+    if(pool)
+        pool->Put(storage, maxlen);
+    else
+        delete[] storage;
+    storage = data = 0;
+    maxlen = 0;
 }
 
 void SUEBuffer::AddData(const char *buf, int size)
 {
+    int oldlen = datalen;
     ProvideMaxLen(datalen + size);
     memcpy(data + datalen, buf, size);
     datalen += size;
+    Added(oldlen);
 }
 
 void SUEBuffer::AddChar(char c)
 {
+    int oldlen = datalen;
     ProvideMaxLen(datalen + 1);
     data[datalen] = c;
     datalen++;
+    Added(oldlen);
 }
 
 int SUEBuffer::GetData(char *buf, int size)
@@ -55,7 +209,7 @@ int SUEBuffer::GetData(char *buf, int size)
     if(size >= datalen) { // all data to be read/removed
         memcpy(buf, data, datalen);
         int ret = datalen;
-        datalen = 0;
+        DropAll();
         return ret;
     } else { // only a part of the data to be removed
         memcpy(buf, data, size);
@@ -66,11 +220,17 @@ int SUEBuffer::GetData(char *buf, int size)
 
 void SUEBuffer::DropData(int size)
 {
-    EraseData(0, size);
+    Consume(size);
 }
 
 void SUEBuffer::EraseData(int index, int size)
 {
+    if(index == 0) {
+        Consume(size);
+        return;
+    }
+    if(scanned > index)
+        scanned = index;
     if(index+size>=datalen) {
         datalen = index;
     } else {
@@ -85,11 +245,22 @@ void SUEBuffer::AddString(const char *str)
 }
 
 
+  // memchr(3) is much faster than a loop; remember where it stopped
+  // so that the next call doesn't look at the same bytes again
+int SUEBuffer::FindEol() const
+{
+    const char *p = (const char*)memchr(data+scanned, '\n', datalen-scanned);
+    if(!p) {
+        scanned = datalen;
+        return -1;
+    }
+    scanned = p - data;
+    return scanned;
+}
+
 int SUEBuffer::ReadLine(char *buf, int bufsize)
 {
-    int crindex = -1;
-    for(int i=0; i< datalen; i++)
-        if(data[i] == '\n') { crindex = i; break; }
+    int crindex = FindEol();
     if(crindex == -1) return 0;
     if(crindex >= bufsize) { // no room for the whole string
         memcpy(buf, data, bufsize-1);
@@ -99,7 +270,7 @@ int SUEBuffer::ReadLine(char *buf, int bufsize)
         GetData(buf, crindex+1);
         //assert(buf[crindex] == '\n');
         buf[crindex] = 0;
-        if(buf[crindex - 1] == '\r')
+        if(crindex > 0 && buf[crindex - 1] == '\r')
             buf[crindex-1] = 0;
     }
     return crindex + 1;
@@ -107,35 +278,64 @@ int SUEBuffer::ReadLine(char *buf, int bufsize)
 
 bool SUEBuffer::ReadLine(SUEBuffer &dest)
 {
-    int crindex = -1;
-    for(int i=0; i< datalen; i++)
-        if(data[i] == '\n') { crindex = i; break; }
+    int crindex = FindEol();
     if(crindex == -1) return false;
+    int oldlen = dest.datalen;
+    dest.DropAll();
     dest.ProvideMaxLen(crindex+1);
     GetData(dest.data, crindex+1);
     dest.datalen = crindex+1;
+    dest.Added(oldlen);
     //assert(dest.data[crindex] == '\n');
     dest.data[crindex] = 0;
-    if(dest.data[crindex-1] == '\r')
+    if(crindex > 0 && dest.data[crindex-1] == '\r')
         dest.data[crindex-1] = 0;
     return true;
 }
 
+char *SUEBuffer::NextLine(int &pos, int &len)
+{
+    if(pos >= datalen)
+        return 0;
+    int eol;
+    if(pos <= scanned) {
+          // the EOLs of the lines before pos are zeroes already
+        eol = FindEol();
+        if(eol == -1)
+            return 0;
+        scanned = eol + 1;
+    } else {
+        const char *p = (const char*)memchr(data+pos, '\n', datalen-pos);
+        if(!p)
+            return 0;
+        eol = p - data;
+    }
+    char *line = data + pos;
+    len = eol - pos;
+    if(len > 0 && line[len-1] == '\r')
+        len--;
+    line[len] = 0;
+    data[eol] = 0;
+    pos = eol + 1;
+    return line;
+}
+
 int SUEBuffer::FindLineMarker(const char *marker) const
 {
-    for(int i = 0; i< datalen; i++) {
-        if(data[i] == '\r') i++;
-        if(data[i] != '\n') continue;
-        bool found = true;
-        int j = 1;
-        for(const char *p = marker;*p;p++,j++) {
-            if(/* data[i+j]=='\0' ||*/ data[i+j] != *p)
-                { found = false; break; }
+    int mlen = strlen(marker);
+      // the marker line may only start right after an EOL
+    int i = FindEol();
+    while(i != -1) {
+        int j = i + 1 + mlen;
+        if(j >= datalen)
+            return -1;
+        if(memcmp(data + i + 1, marker, mlen) == 0) {
+            if(data[j] == '\r' && j + 1 < datalen) j++;
+            if(data[j] == '\n')
+                return j;
         }
-        if(!found) continue;
-        if(data[i+j] == '\r') j++;
-        if(data[i+j] != '\n') continue;
-        return i+j;
+        const char *p = (const char*)memchr(data+i+1, '\n', datalen-i-1);
+        i = p ? p - data : -1;
     }
     return -1;
 }
@@ -155,10 +355,13 @@ bool SUEBuffer::ReadUntilLineMarker(const char *marker, SUEBuffer &dest)
 {
     int ind = FindLineMarker(marker);
     if(ind == -1) return false;
+    int oldlen = dest.datalen;
+    dest.DropAll();
     dest.ProvideMaxLen(ind+2);
     GetData(dest.data, ind+1);
     dest.data[ind+1] = 0;
     dest.datalen = ind+1;
+    dest.Added(oldlen);
     return true;
 }
 
@@ -173,18 +376,62 @@ bool SUEBuffer::ContainsExactText(const char *str) const
 
 void SUEBuffer::ProvideMaxLen(int n)
 {
-    if(n <= maxlen) return;
-    int newlen = maxlen;
+    if(data + n <= storage + maxlen) return;
+    if(n <= maxlen && data - storage >= datalen) {
+          // the bytes moved are paid for by the bytes consumed before
+        memmove(storage, data, datalen);
+        data = storage;
+        return;
+    }
+    int newlen = maxlen > 0 ? maxlen * 2 : SUE_BUFFER_MIN_BLOCK;
     while(newlen < n) newlen*=2;
-    char *newbuf = new char[newlen];
-    memcpy(newbuf, data, datalen);
-    delete [] data;
+    char *newbuf;
+    if(pool) 
+        newbuf = pool->Get(newlen, newlen);
+    else
+        newbuf = new char[newlen];
+    if(storage) {
+        memcpy(newbuf, data, datalen);
+        FreeStorage();
+    }
+    storage = newbuf;
     data = newbuf;
     maxlen = newlen;
 }
 
 
 
+// SUEPayload
+
+SUEPayload::SUEPayload(const char *a_data, int a_len)
+{
+    refcount = 1;
+    len = a_len;
+    data = new char[len > 0 ? len : 1];
+    memcpy(data, a_data, len);
+}
+
+SUEPayload::SUEPayload(const char *str)
+{
+    refcount = 1;
+    len = strlen(str);
+    data = new char[len > 0 ? len : 1];
+    memcpy(data, str, len);
+}
+
+void SUEPayload::AddRef()
+{
+    __atomic_add_fetch(&refcount, 1, __ATOMIC_RELAXED);
+}
+
+void SUEPayload::Release()
+{
+    if(__atomic_sub_fetch(&refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        delete this;
+}
+
+
+
 // SUEGenericDuplexSession
 
 void SUEGenericDuplexSession::TimeoutHandle()
@@ -195,39 +442,156 @@ void SUEGenericDuplexSession::TimeoutHandle()
 void SUEGenericDuplexSession::FdHandle(bool a_r, bool a_w, bool /*a_ex*/)
 {
     if(a_r) {
-        char buf[1024];
-        int rb = read(fd, buf, sizeof(buf));
-        if(rb>0) {
-            if(inputresetstimeout)
-                ResetTimeout();
-            inputbuffer.AddData(buf, rb);
-            HandleNewInput();
-        } else if(rb==0) {
-            HandleRemoteClosing();
-            return;
-        } else {
-            HandleReadError();
+        int total = 0;
+        int rb;
+        for(;;) {
+            rb = read(fd, inputbuffer.GetSpace(readsize), readsize);
+            if(rb <= 0)
+                break;
+            inputbuffer.CommitSpace(rb);
+            total += rb;
+            if(rb == readsize) {
+                if(readsize < SUE_READ_SIZE_MAX)
+                    readsize *= 2;
+            } else {
+                if(rb < readsize / 4 && readsize > SUE_READ_SIZE_MIN)
+                    readsize /= 2;
+                  // a short read means there's nothing more for now,
+                  // so don't waste a call to see EAGAIN
+                break;
+            }
+            if(total >= SUE_READ_BUDGET)
+                break;
+        }
+        if(total > 0) {
+              // the end of file or an error (if any) will be seen 
+              // next time, as the descriptor remains readable
+            HandleReadResult(total);
+        } else 
+        if(rb == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && 
+                       errno != EINTR))
+        {
+            HandleReadResult(rb);
+            return;  // the object might have been deleted
+        } else
+        if(inputbuffer.Length() == 0) {
+              // give the space got for nothing back to the pool
+            inputbuffer.DropAll();
         }
     }
     if(a_w) {
-        int len = outputbuffer.Length();
-        if(len) {
-            int wb = write(fd, outputbuffer.GetBuffer(), len);
-            if(wb>0) { 
-                if(outputresetstimeout)
-                    ResetTimeout();
-                outputbuffer.DropData(wb);
-            } else if(wb==-1) {
-                HandleWriteError();
-            } else {
-                 /* simply ignore this situation */
-            }
-            if(scheduleddown && outputbuffer.Length() == 0) 
-                 Shutdown();
+        if(OutputLength()) {
+            int wb = WriteOutput();
+            if(OutputLength() == 0)
+                InterestChanged();
+            HandleWriteResult(wb);
+        } else {
+              // emptied by someone else
+            InterestChanged();
         }
     }
 }
 
+void SUEGenericDuplexSession::FlushHandle()
+{
+    UpdateOutputState();
+    if(outputoverflow) {
+        HandleOutputOverflow();
+        return;  // the object might have been deleted
+    }
+    if(outputreported != outputcongested) {
+        outputreported = outputcongested;
+          // come back for the writing after the hook, still within 
+          // this iteration, unless the hook ends the session
+        the_selector->RequestFlush(this);
+        HandleOutputCongestion(outputcongested);
+        return;  // the object might have been deleted
+    }
+    if(uringslot || !OutputLength())
+        return;
+    int wb = WriteOutput();
+      // either there's something left to wait for the descriptor to 
+      // get writable, or we might have been waiting for that
+    InterestChanged();
+    HandleWriteResult(wb);
+}
+
+  // write as much of the output queued as possible; returns what
+  // write(2) does, except that would-block situations give 0
+int SUEGenericDuplexSession::WriteOutput()
+{
+    struct iovec iov[SUE_WRITEV_MAX];
+    int cnt = GatherOutput(iov, SUE_WRITEV_MAX);
+    int wb = -1;
+    if(!notsocket) {
+          // sendmsg(2) lets us avoid SIGPIPE if the peer is gone
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        wb = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(wb == -1 && errno == ENOTSOCK)
+            notsocket = true;
+    }
+    if(notsocket)
+        wb = writev(fd, iov, cnt);
+    if(wb > 0)
+        ConsumeOutput(wb);
+    else 
+    if(wb == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || 
+                    errno == EINTR))
+    {
+        wb = 0;
+    }
+    return wb;
+}
+
+  // the data (if any) is already in the inputbuffer
+void SUEGenericDuplexSession::HandleReadResult(int len)
+{
+    if(len>0) {
+        if(inputresetstimeout)
+            ResetTimeout();
+        HandleNewInput();
+    } else if(len==0) {
+        HandleRemoteClosing();
+    } else {
+        HandleReadError();
+    }
+}
+
+  // the data sent (if any) is already removed from the outputbuffer
+void SUEGenericDuplexSession::HandleWriteResult(int len)
+{
+    if(len>0) { 
+        if(outputresetstimeout)
+            ResetTimeout();
+    } else if(len==-1) {
+        HandleWriteError();
+        return;  // the object might have been deleted
+    } else {
+         /* simply ignore this situation */
+    }
+    if(scheduleddown && OutputLength() == 0 && 
+        !(uringslot && the_selector->GetUring()->IsSending(uringslot)))
+    {
+         Shutdown();
+    }
+}
+
+#ifndef SUE_SESSION_TIMEOUT_SLACK
+#define SUE_SESSION_TIMEOUT_SLACK 1000000
+#endif
+
+  // Idle timeouts don't need to be precise, so let them come a bit 
+  // late, all at once: an eighth of the timeout, but not more than 
+  // SUE_SESSION_TIMEOUT_SLACK microseconds 
+static long session_timeout_slack(long sec, long usec)
+{
+    long long t = ((long long)sec * 1000000 + usec) / 8;
+    return t < SUE_SESSION_TIMEOUT_SLACK ? t : SUE_SESSION_TIMEOUT_SLACK;
+}
+
 SUEGenericDuplexSession::SUEGenericDuplexSession( 
                             int a_timeout, 
                             const char *a_greeting) 
@@ -236,12 +600,25 @@ SUEGenericDuplexSession::SUEGenericDuplexSession(
     the_selector = 0;  
     timeout_sec = a_timeout;
     timeout_usec = 0;
+    SetSlack(session_timeout_slack(timeout_sec, timeout_usec));
     if(a_greeting) {
         outputbuffer.AddData(a_greeting, strlen(a_greeting));
     }
     scheduleddown = false;
+    notsocket = false;
+    readsize = SUE_READ_SIZE_MIN;
+    uringslot = 0;
+    firstpayload = lastpayload = 0;
+    payloadsent = 0;
+    payloadbytes = 0;
+    outputhigh = outputlow = outputhard = 0;
+    outputpolicy = output_mark;
+    outputcongested = outputreported = outputoverflow = false;
+    outputaccounted = 0;
     inputresetstimeout = true;
     outputresetstimeout = true;
+    TrackInterest();
+    outputbuffer.SetWatcher(this);
 }
 
 SUEGenericDuplexSession::~SUEGenericDuplexSession()
@@ -258,7 +635,18 @@ void SUEGenericDuplexSession::Startup(SUEEventSelector *a_selector,
         outputbuffer.AddData(a_greeting, strlen(a_greeting));
     }
     SetFd(a_fd);
-    the_selector->RegisterFdHandler(this);
+      // FdHandle() and FlushHandle() go on until EAGAIN
+    int flags = fcntl(a_fd, F_GETFL);
+    if(flags != -1 && !(flags & O_NONBLOCK))
+        fcntl(a_fd, F_SETFL, flags | O_NONBLOCK);
+    inputbuffer.SetPool(the_selector->GetBufferPool());
+    outputbuffer.SetPool(the_selector->GetBufferPool());
+    if(the_selector->GetUring())
+        uringslot = the_selector->GetUring()->Attach(this, a_fd);
+    else
+        the_selector->RegisterFdHandler(this);
+    if(OutputLength() > 0)
+        OutputAdded();
     if(timeout_sec>0 || timeout_usec>0) {
         SetFromNow(timeout_sec, timeout_usec);
         the_selector->RegisterTimeoutHandler(this);
@@ -268,10 +656,26 @@ void SUEGenericDuplexSession::Startup(SUEEventSelector *a_selector,
 void SUEGenericDuplexSession::Shutdown()
 {
     if(the_selector) {
-        the_selector->RemoveFdHandler(this);
+        if(uringslot)
+            the_selector->GetUring()->Detach(uringslot);
+        else
+            the_selector->RemoveFdHandler(this);
+        the_selector->CancelFlush(this);
         the_selector->RemoveTimeoutHandler(this);
     }
     the_selector = 0;
+    uringslot = 0;
+    DropPayloads();
+      // what's not sent won't be; the memory of the input still in the
+      // buffer goes to the heap, as the selector may be gone by the 
+      // time we are deleted
+    outputbuffer.DropAll();
+    inputbuffer.SetPool(0);
+    outputbuffer.SetPool(0);
+    if(outputaccounted) {
+        __atomic_sub_fetch(&totaloutput, outputaccounted, __ATOMIC_RELAXED);
+        outputaccounted = 0;
+    }
     if(fd != -1) {
         close(fd);
         SetFd(-1);
@@ -279,6 +683,187 @@ void SUEGenericDuplexSession::Shutdown()
     }
 }
 
+void SUEGenericDuplexSession::BufferFilled(SUEBuffer *)
+{
+    OutputAdded();
+}
+
+void SUEGenericDuplexSession::BufferGrown(SUEBuffer *)
+{
+    UpdateOutputState();
+}
+
+void SUEGenericDuplexSession::OutputAdded()
+{
+    if(uringslot)
+        the_selector->GetUring()->OutputPending(uringslot);
+    else if(the_selector)
+        the_selector->RequestFlush(this);
+}
+
+void SUEGenericDuplexSession::QueuePayload(SUEPayload *p)
+{
+    if(p->Length() == 0)
+        return;
+    bool wasempty = OutputLength() == 0;
+    p->AddRef();
+    PayloadItem *item = new PayloadItem;
+    item->payload = p;
+    item->pos = outputbuffer.Consumed() + outputbuffer.Length();
+    item->next = 0;
+    if(lastpayload)
+        lastpayload->next = item;
+    else
+        firstpayload = item;
+    lastpayload = item;
+    payloadbytes += p->Length();
+    if(wasempty)
+        OutputAdded();
+    UpdateOutputState();
+}
+
+  // fill the vector with the output queued, in the right order; 
+  // returns the count of the elements used
+int SUEGenericDuplexSession::GatherOutput(struct iovec *iov, 
+                                          int iovcnt) const
+{
+    const char *buf = outputbuffer.GetBuffer();
+    unsigned long long bufstart = outputbuffer.Consumed();
+    int taken = 0;  // bytes of the outputbuffer already in the vector
+    int n = 0;
+    int skip = payloadsent;
+    for(PayloadItem *p = firstpayload; p && n < iovcnt; p = p->next) {
+        int before = p->pos > bufstart ? p->pos - bufstart : 0;
+        if(before > taken) {
+            iov[n].iov_base = (void*)(buf + taken);
+            iov[n].iov_len = before - taken;
+            taken = before;
+            n++;
+            if(n >= iovcnt)
+                break;
+        }
+        iov[n].iov_base = (void*)(p->payload->GetData() + skip);
+        iov[n].iov_len = p->payload->Length() - skip;
+        skip = 0;
+        n++;
+    }
+    if(n < iovcnt && outputbuffer.Length() > taken) {
+        iov[n].iov_base = (void*)(buf + taken);
+        iov[n].iov_len = outputbuffer.Length() - taken;
+        n++;
+    }
+    return n;
+}
+
+  // remove the first len bytes of the output queued
+void SUEGenericDuplexSession::ConsumeOutput(int len)
+{
+    while(len > 0) {
+        if(firstpayload && firstpayload->pos <= outputbuffer.Consumed()) {
+              // the payload goes first
+            PayloadItem *p = firstpayload;
+            int rest = p->payload->Length() - payloadsent;
+            if(len < rest) {
+                payloadsent += len;
+                payloadbytes -= len;
+                break;
+            }
+            len -= rest;
+            payloadbytes -= rest;
+            payloadsent = 0;
+            firstpayload = p->next;
+            if(!firstpayload)
+                lastpayload = 0;
+            p->payload->Release();
+            delete p;
+        } else {
+              // the outputbuffer's bytes before the payload go first
+            int chunk = outputbuffer.Length();
+            if(firstpayload) {
+                unsigned long long before = 
+                    firstpayload->pos - outputbuffer.Consumed();
+                if(before < (unsigned long long)chunk)
+                    chunk = before;
+            }
+            if(chunk > len)
+                chunk = len;
+            if(chunk == 0)
+                break;  // shouldn't happen
+            outputbuffer.DropData(chunk);
+            len -= chunk;
+        }
+    }
+    UpdateOutputState();
+}
+
+void SUEGenericDuplexSession::DropPayloads()
+{
+    while(firstpayload) {
+        PayloadItem *p = firstpayload;
+        firstpayload = p->next;
+        p->payload->Release();
+        delete p;
+    }
+    lastpayload = 0;
+    payloadsent = 0;
+    payloadbytes = 0;
+}
+
+long long SUEGenericDuplexSession::totaloutput = 0;
+
+long long SUEGenericDuplexSession::TotalOutputLength()
+{
+    return __atomic_load_n(&totaloutput, __ATOMIC_RELAXED);
+}
+
+void SUEGenericDuplexSession::SetOutputLimits(int high, int low, 
+                                              OutputPolicy policy, 
+                                              int hardlimit)
+{
+    outputhigh = high;
+    outputlow = low < high ? low : high;
+    outputpolicy = policy;
+    outputhard = hardlimit;
+    UpdateOutputState();
+}
+
+  // take account of the output queue's length; the hooks are called 
+  // later, from FlushHandle(), as we may be deep inside someone's 
+  // code here
+void SUEGenericDuplexSession::UpdateOutputState()
+{
+    int len = OutputLength();
+    if(len != outputaccounted) {
+        __atomic_add_fetch(&totaloutput, len - outputaccounted, 
+                           __ATOMIC_RELAXED);
+        outputaccounted = len;
+    }
+    bool wascongested = outputcongested;
+    if(outputhigh <= 0)
+        outputcongested = false;
+    else if(len > outputhigh)
+        outputcongested = true;
+    else if(len <= outputlow)
+        outputcongested = false;
+    bool overflow = (outputhard > 0 && len > outputhard) ||
+        (outputcongested && outputpolicy == output_disconnect);
+      // the outputbuffer tells us when it grows past the next limit
+    int limit = outputcongested ? outputhard : outputhigh;
+    if(limit > 0 && !overflow)
+        outputbuffer.SetWatchLimit(limit > payloadbytes ? 
+                                   limit - payloadbytes : 0);
+    else
+        outputbuffer.SetWatchLimit(-1);
+    if(outputcongested == wascongested && overflow == outputoverflow)
+        return;
+    outputoverflow = overflow;
+    if(!the_selector)
+        return;
+    if(outputpolicy == output_stop_reading && !uringslot)
+        InterestChanged();
+    the_selector->RequestFlush(this);
+}
+
 void SUEGenericDuplexSession::GracefulShutdown()
 {
     scheduleddown = true;
@@ -286,10 +871,11 @@ void SUEGenericDuplexSession::GracefulShutdown()
 
 void SUEGenericDuplexSession::ResetTimeout()
 {
-    the_selector->RemoveTimeoutHandler(this);
     if(timeout_sec>0 || timeout_usec>0) {
         SetFromNow(timeout_sec, timeout_usec);
-        the_selector->RegisterTimeoutHandler(this);
+        the_selector->RearmTimeoutHandler(this);
+    } else {
+        the_selector->RemoveTimeoutHandler(this);
     }
 }
 
@@ -297,5 +883,6 @@ void SUEGenericDuplexSession::SetTimeout(int sec, int usec)
 {
     timeout_sec = sec;
     timeout_usec = usec;
+    SetSlack(session_timeout_slack(timeout_sec, timeout_usec));
     if(the_selector) ResetTimeout();
 }
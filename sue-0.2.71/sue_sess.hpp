@@ -24,17 +24,121 @@
 #include "sue_sel.hpp"
 #endif
 
+#ifndef SENTRY_SUE_URING_HPP
+#include "sue_uring.hpp"
+#endif
+
+
+class SUEBuffer;
+
+#ifndef SUE_BUFFER_POOL_CLASSES
+  //! Blocks of 512 bytes to 64 Kb are pooled, see SUEBufferPool
+#define SUE_BUFFER_POOL_CLASSES 8
+#endif
+
+//! Free memory blocks for the buffers served by the same selector
+/*! Blocks are sized in powers of two, starting from 512 bytes; every 
+    size class has a list of free blocks.  A buffer which uses a pool 
+    (see SUEBuffer::SetPool()) takes a block only when it gets data, 
+    and gives it back as soon as it's emptied, so a session which has 
+    nothing to read or send holds no memory at all.  Larger blocks are
+    taken from the heap directly.
+    \par
+    The blocks that stay unused in the pool for a while are freed: 
+    every SUE_BUFFER_POOL_TRIM seconds, each class loses as many free 
+    blocks as it had all the time since the last trim, so the memory
+    taken by a burst of traffic goes back to the system soon after.
+    \note The pool is not thread-safe; the buffers using it must all 
+    be served by the thread of its selector.  Get the pool with 
+    SUEEventSelector::GetBufferPool().
+ */
+class SUEBufferPool : private SUETimeoutHandler {
+    SUEEventSelector *the_selector;
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+    struct SizeClass {
+        FreeBlock *first;
+        int count;
+          //! the least count since the last trim
+        int lowcount;
+    } classes[SUE_BUFFER_POOL_CLASSES];
+    long long idlebytes;
+    bool trimscheduled;
+public:
+      //! Constructor
+    SUEBufferPool(SUEEventSelector *a_selector);
+      //! Destructor; all the free blocks are deleted
+    ~SUEBufferPool();
+
+      //! Get a block of at least size bytes
+      /*! Returns the block; its actual size is stored to got */
+    char *Get(int size, int &got);
+      //! Give the block back
+      /*! \param size is what Get() stored as the block's size */
+    void Put(char *block, int size);
+
+      //! How many bytes the free blocks take
+    long long IdleBytes() const { return idlebytes; }
+
+private:
+    virtual void TimeoutHandle();
+    static int ClassOf(int size);
+};
+
+//! Object to be told when a buffer gets data
+/*! See SUEBuffer::SetWatcher() */
+class SUEBufferWatcher {
+public:
+    virtual ~SUEBufferWatcher() {}
+      //! Called right after data is added to the empty buffer
+    virtual void BufferFilled(SUEBuffer *buf) = 0;
+      //! Called right after the buffer outgrows its watch limit
+      /*! See SUEBuffer::SetWatchLimit() */
+    virtual void BufferGrown(SUEBuffer *buf) {}
+};
 
 //! Buffer used by sessions
+/*! The data is kept contiguous, but it doesn't always start at the 
+    beginning of the allocated memory: removing data from the beginning
+    just moves the start forward, so reading a buffer piece by piece
+    doesn't cost more than reading it at once.  The free space at the 
+    beginning is reused when it's not less than the data to be moved.
+    \par
+    No memory is allocated until data is added.  A buffer which uses a
+    pool (see SetPool()) also gives its memory back when it gets empty.
+ */
 class SUEBuffer {
-    char *data;
+    char *storage;  //!< allocated memory
+    char *data;     //!< the first byte of the data, within the storage
     int datalen;
-    int maxlen;
+    int maxlen;     //!< size of the storage
+    unsigned long long consumed;  //!< bytes ever removed from the start
+    SUEBufferWatcher *watcher;
+    int watchlimit;
+      //! How many bytes at the start are known to contain no EOL
+    mutable int scanned;
+    SUEBufferPool *pool;
 public:
       //! Constructor
     SUEBuffer();
       //! Destructor
     ~SUEBuffer();
+
+      //! Set the object to be told when the buffer stops being empty
+      /*! Only one watcher is supported; 0 removes it. */
+    void SetWatcher(SUEBufferWatcher *w) { watcher = w; }
+      //! Set the length the watcher wants to know the buffer exceeds
+      /*! The watcher is told each time data added makes the length 
+          go above the limit; -1 (the default) means no limit.
+       */
+    void SetWatchLimit(int limit) { watchlimit = limit; }
+      //! Take the memory from the pool, and give it back once empty
+      /*! 0 (the default) means to use the heap, and to keep the memory
+          for reuse until the buffer is destroyed.
+          \note The memory already taken is kept either way.
+       */
+    void SetPool(SUEBufferPool *p) { pool = p; }
     
       //! Add some data to the end 
       /*! The buffer is enlarged and data is added */
@@ -60,11 +164,28 @@ public:
     void EraseData(int index, int len);
 
       //! Empty the buffer
-    void DropAll() { datalen = 0; } 
+    void DropAll() { 
+        consumed += datalen; data = storage; datalen = 0; scanned = 0; 
+        if(pool && storage) 
+            FreeStorage();
+    }
     
       //! Add a char to the end of the buffer
     void AddChar(char c);
 
+      //! Get room for data at the end of the buffer
+      /*! Returns the pointer to at least size bytes of free space 
+          right after the data, so that the data may be placed there
+          directly (e.g., by read(2)), then added with CommitSpace().
+          \warning The pointer is only valid until the buffer is 
+          changed.
+       */
+    char *GetSpace(int size) 
+        { ProvideMaxLen(datalen + size); return data + datalen; }
+      //! Add the data placed to the space got with GetSpace()
+    void CommitSpace(int size) 
+        { int oldlen = datalen; datalen += size; Added(oldlen); }
+
       //! Add a string to the end of the buffer
       /*! The string pointed by str is added to the buffer.
           Terminating zero is not copied, only the string itself.
@@ -80,6 +201,9 @@ public:
           so at most bufsize-1 bytes are copied. If there is no room 
           for the whole string, than only a part is copied. 
           The terminating EOL is never stored in the buffer. 
+          \note The bytes found to contain no EOL are not looked at 
+          again by the next call, so a long line arriving by small 
+          pieces costs no more than the one arrived at once.
        */
     int ReadLine(char *buf, int bufsize);
       //! Read a line into another buffer
@@ -93,6 +217,25 @@ public:
           The terminating EOL is never stored in the buffer. 
        */
     bool ReadLine(SUEBuffer &buf);
+
+      //! Get the next complete line right in the buffer
+      /*! Use this to handle all the lines received without copying 
+          them anywhere: start with pos of 0, call the method until it
+          returns 0, then remove the lines handled with DropData(pos).
+          \code
+            int pos = 0, len;
+            while(char *line = inputbuffer.NextLine(pos, len))
+                HandleLine(line);
+            inputbuffer.DropData(pos);
+          \endcode
+          The EOL (and the CR before it, if any) is replaced with the 
+          zero byte, so the line is a string; its length (not counting
+          the EOL) is stored to len, and pos is moved to the next line.
+          \warning The lines are only valid until the buffer is changed,
+          and the buffer must not be used otherwise until DropData(pos)
+          is done.
+       */
+    char *NextLine(int &pos, int &len);
     
       //! Find the given line in the buffer
       /*! returns the index of the '\n' right after the marker */ 
@@ -117,8 +260,17 @@ public:
       //! How much data is in the buffer
       /*! How many bytes does the buffer contain */
     int Length() const { return datalen; }
+      //! How much data was ever removed from the beginning
+      /*! This is, in fact, the position of the first byte of the
+          buffer in the stream of all the bytes ever added.
+          \note EraseData() doesn't count unless it erases from
+          the beginning.
+       */
+    unsigned long long Consumed() const { return consumed; }
       //! Access the given byte
-      /*! \warning No range checking is performed. Passing
+      /*! \warning Don't store the EOL character this way, as the
+          methods reading lines may have already looked at the byte.
+          \warning No range checking is performed. Passing
           negative i or i more than the current buffer length
           (as returned by Length() method) could lead to an 
           unpredictable behaviour and/or crash.
@@ -126,7 +278,65 @@ public:
     char& operator[](int i) const { return *(data + i); }
 
 private:
+      //! Make room for n bytes of data at the current start
     void ProvideMaxLen(int n);
+    void FreeStorage();
+      //! Remove n bytes from the beginning
+    void Consume(int n) {
+        if(n >= datalen) 
+            DropAll();
+        else
+            { data += n; datalen -= n; consumed += n; 
+              scanned = scanned > n ? scanned - n : 0; }
+    }
+      //! Index of the first EOL, or -1
+    int FindEol() const;
+    void Added(int oldlen) {
+        if(!watcher)
+            return;
+        if(oldlen == 0 && datalen > 0)
+            watcher->BufferFilled(this);
+        if(watchlimit >= 0 && datalen > watchlimit && oldlen <= watchlimit)
+            watcher->BufferGrown(this);
+    }
+};
+
+
+//! Immutable data shared by several sessions
+/*! This is to send the same data to many sessions without copying
+    it for each of them, see SUEGenericDuplexSession::QueuePayload().
+    The object is reference counted, and it deletes itself when the
+    last reference is released.  The counter is changed atomically,
+    so sessions served by different threads may share the object.
+ */
+class SUEPayload {
+    int refcount;
+    int len;
+    char *data;
+public:
+      //! Constructor
+      /*! The data is copied; the reference count is 1. */
+    SUEPayload(const char *a_data, int a_len);
+      //! Constructor
+      /*! The string is copied, without the terminating zero; the 
+          reference count is 1. 
+       */
+    SUEPayload(const char *str);
+
+      //! Get one more reference
+    void AddRef();
+      //! Release a reference, delete the object if it was the last one
+    void Release();
+
+      //! The data
+    const char *GetData() const { return data; }
+      //! How many bytes the payload contains
+    int Length() const { return len; }
+private:
+    ~SUEPayload() { delete[] data; }
+      // no copying
+    SUEPayload(const SUEPayload&);
+    void operator=(const SUEPayload&);
 };
 
 
@@ -151,6 +361,8 @@ private:
     \par
     Use Startup(), Shutdown() and GracefulShutdown() to control
     the session.
+    \note The descriptor is switched to the non-blocking mode by 
+    Startup(), as it is read and written until the kernel says EAGAIN.
     \note You can make your objects delete themselves once the session
     is terminated. In this case, override ShutdownHook() and put the 
     operator delete this; there. 
@@ -163,8 +375,11 @@ private:
     not both.
  */
 class SUEGenericDuplexSession : protected SUEFdHandler, 
-                                private SUETimeoutHandler 
+                                private SUETimeoutHandler,
+                                private SUEBufferWatcher,
+                                private SUEFlushHandler
 {
+    friend class SUEUring;
 
     long timeout_sec; //! Timeout, seconds
     long timeout_usec; //! Timeout, microseconds
@@ -172,6 +387,42 @@ class SUEGenericDuplexSession : protected SUEFdHandler,
       //! Are we going to go down once the output queue's empty
     bool scheduleddown; 
 
+      //! Is the descriptor known to be not a socket
+    bool notsocket;
+
+      //! How much to ask read(2) for, adapted to the traffic
+    int readsize;
+
+      //! The io_uring engine's slot, if the selector has the engine
+    SUEUring::Slot *uringslot;
+
+      //! Payloads queued for sending, see QueuePayload()
+    struct PayloadItem {
+        SUEPayload *payload;
+          //! Position in the outputbuffer's stream it is to be sent at
+        unsigned long long pos;
+        PayloadItem *next;
+    } *firstpayload, *lastpayload;
+      //! Bytes of the first payload sent already
+    int payloadsent;
+      //! Total length of the queued payloads, minus payloadsent
+    int payloadbytes;
+
+      //! Output water marks and policy, see SetOutputLimits()
+    int outputhigh, outputlow, outputhard;
+    int outputpolicy;
+      //! Is the output queue above the high water mark (and not yet 
+      //! drained below the low one)
+    bool outputcongested;
+      //! The state last reported to HandleOutputCongestion()
+    bool outputreported;
+      //! Is the queue over the hard limit
+    bool outputoverflow;
+      //! Our share of the TotalOutputLength()
+    int outputaccounted;
+      //! Output queued by all the sessions of the process
+    static long long totaloutput;
+
 protected: 
 
       //! Pointer to the SUEEventSelector object used here. 
@@ -192,6 +443,13 @@ protected:
       /*! This function overrides SUEFdHandler::FdHandle().
           It then performs read(2) on the socket and then calls
           the appropriate method depending on the results. 
+          \par
+          The data is read right into the inputbuffer, until the 
+          descriptor has no more or SUE_READ_BUDGET bytes are read, so
+          that a busy session doesn't starve the others; all the data
+          is then passed to HandleNewInput() at once.  The size of a 
+          single read grows while the reads fill it up, and shrinks 
+          back when they get much less.
           \note Forget this function unless you'd like to 
           reimplement the library. For regular modifying of
           your object's behaviour, use overriding of HandleNewInput(),
@@ -207,18 +465,60 @@ protected:
           your object's behaviour, override HandleSessionTimeout().
         */
     virtual void TimeoutHandle();
+
+      //! callback function for the end of the loop iteration
+      /*! Whatever was queued for sending during the iteration is
+          written right away, as much as the descriptor accepts 
+          without blocking; the selector is only asked to tell when
+          the descriptor gets writable if something is left.
+          \note This relies on the descriptor being non-blocking, which 
+          Startup() takes care of.
+       */
+    virtual void FlushHandle();
   
       
-      /*! We're always ready to read everything they sent us */
-    virtual bool WantRead() const { return true; }
+      /*! We're always ready to read everything they sent us, unless
+          the output is congested and the policy says to stop reading
+          (see SetOutputLimits())
+       */
+    virtual bool WantRead() const 
+        { return !(outputcongested && outputpolicy == output_stop_reading); }
       /*! Sometimes (when the output queue is not empty) we need to 
         know when to write. 
+        \note The session tracks its interest (see 
+        SUEFdHandler::TrackInterest()): the selector is told after the
+        output queue is flushed (see FlushHandle()) and when it is 
+        drained.  If you override these methods, call InterestChanged()
+        whenever the result of your version may change.
        */
-    virtual bool WantWrite() const { return outputbuffer.Length() > 0; }
+    virtual bool WantWrite() const { return OutputLength() > 0; }
       /*! In the current version, we don't expect nor handle exceptions */
     virtual bool WantExcept() const { return false; }
 
+      //! Queue a shared payload for sending
+      /*! The payload goes after everything queued before (either 
+          added to the outputbuffer or queued with this method), and
+          before anything added to the outputbuffer later.  The 
+          session holds a reference to the payload until it's sent.
+          \note Don't use EraseData() on the outputbuffer while there 
+          are payloads queued, unless it erases from the beginning.
+       */
+    void QueuePayload(SUEPayload *p);
+      //! How many bytes are queued for sending 
+      /*! Counts both the outputbuffer and the queued payloads */
+    int OutputLength() const { return outputbuffer.Length() + payloadbytes; }
+
 public:
+      //! What to do when the output queue grows too long
+    enum OutputPolicy {
+          //! only tell HandleOutputCongestion(), see IsOutputCongested()
+        output_mark,
+          //! also stop reading from the descriptor until it's drained
+        output_stop_reading,
+          //! call HandleOutputOverflow() right away
+        output_disconnect
+    };
+
       //! Constructor
       /*! 
           \param a_timeout is the value of the timeout (in seconds)
@@ -238,14 +538,46 @@ public:
           \note SetTimeout(0,0) will disable the timing-out feature.
           \note Setting timeout for an active (registered with the
           selector) session forces timeout reset.
+          \note The session may time out up to an eighth of the timeout 
+          (but not more than a second) late, so that timeouts of many 
+          sessions are handled in batches.
        */
     void SetTimeout(int sec, int usec = 0);
 
+      //! Set the output queue limits
+      /*! Once more than high bytes are queued for sending (see 
+          OutputLength()), the output is considered congested until 
+          it is drained down to low bytes; HandleOutputCongestion() is
+          called at the end of the loop iteration in which the state 
+          changes, and the policy decides what else to do.  Regardless
+          of the policy, HandleOutputOverflow() is called once more 
+          than hardlimit bytes are queued (0 means no hard limit).
+          \note high of 0 (the default) disables the limits.
+          \note The state is updated whenever output is queued with 
+          QueuePayload(), sent, or added to the outputbuffer beyond 
+          the limits, so the peer that reads nothing can't make us 
+          miss the moment.
+       */
+    void SetOutputLimits(int high, int low, OutputPolicy policy, 
+                         int hardlimit = 0);
+      //! Is the output queue congested
+      /*! Use this to skip sending what the peer may go without */
+    bool IsOutputCongested() const { return outputcongested; }
+      //! How many bytes all the sessions have queued for sending
+      /*! The sum of OutputLength() of all the sessions of all the
+          threads, as it was the last time each of them took account
+          of its queue; a session does that at least once per loop 
+          iteration in which it sends anything. 
+       */
+    static long long TotalOutputLength();
+
       //! Start the session
       /*! This method sets the file descriptor and registers the 
           handlers at the selector. 
           \param a_selector is the pointer to your SUEEventSelector
-          \param a_fd is the file descriptor of your duplex connection
+          \param a_fd is the file descriptor of your duplex connection;
+                 it is put into the non-blocking mode (O_NONBLOCK), so
+                 don't share it with anything expecting it to block
           \param a_greeting if specified, this string is sent to the 
                  remote end right after the connection is established
        */
@@ -323,8 +655,35 @@ public:
        */ 
     virtual void HandleRemoteClosing() { Shutdown(); }
 
+      //! Hook for handling output congestion
+      /*! Called at the end of the loop iteration in which the output
+          queue gets congested (congested is true) or drained enough
+          (false).  See SetOutputLimits().  Does nothing by default.
+       */
+    virtual void HandleOutputCongestion(bool congested) {}
+
+      //! Hook for handling output overflow
+      /*! Called at the end of the loop iteration in which the output
+          queue exceeds the hard limit, or gets congested under the 
+          output_disconnect policy.  By default, it calls Shutdown().
+          \note If you override it to keep the session, get the queue
+          back within the limits, or the hook will be called again
+          the next time the session flushes its output.
+       */
+    virtual void HandleOutputOverflow() { Shutdown(); }
+
 private:
     void ResetTimeout();
+    void HandleReadResult(int len);
+    void HandleWriteResult(int len);
+    int WriteOutput();
+    virtual void BufferFilled(SUEBuffer *buf);
+    virtual void BufferGrown(SUEBuffer *buf);
+    void UpdateOutputState();
+    void OutputAdded();
+    int GatherOutput(struct iovec *iov, int iovcnt) const;
+    void ConsumeOutput(int len);
+    void DropPayloads();
 };
 
 
@@ -113,12 +113,20 @@ bool SUETcpClientSession::WantWrite() const
     return connection_in_progress || SUEGenericDuplexSession::WantWrite();
 }
 
+void SUETcpClientSession::FlushHandle()
+{
+      // the output waits for the connection to be established
+    if(!connection_in_progress) 
+        SUEInetDuplexSession::FlushHandle();
+}
+
 void SUETcpClientSession::FdHandle(bool r, bool w, bool ex)
 {
     if(!connection_in_progress) {
         SUEInetDuplexSession::FdHandle(r, w, ex);
     } else if(w) {
         connection_in_progress = false; 
+        InterestChanged();
         int sockopt; 
         socklen_t sockoptlen = sizeof(sockopt);
         getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&sockopt, &sockoptlen);
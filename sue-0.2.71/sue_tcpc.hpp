@@ -130,6 +130,7 @@ public:
 private:
     virtual bool WantWrite() const;
     virtual void FdHandle(bool a_r, bool a_w, bool a_ex); 
+    virtual void FlushHandle();
 };
 
 
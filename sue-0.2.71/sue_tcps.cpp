@@ -24,17 +24,44 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
+#include "sue_thr.hpp"
 #include "sue_tcps.hpp"
 
 
+#ifndef SUE_TCP_BACKLOG
+#define SUE_TCP_BACKLOG SOMAXCONN
+#endif
+
+  // how many connections to accept before the sessions get their turn
+#ifndef SUE_ACCEPT_BUDGET
+#define SUE_ACCEPT_BUDGET 64
+#endif
+
+static int open_spare_fd()
+{
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+
 SUETcpServer::SUETcpServer(const char *a_ip, int a_port)
 {
     port = a_port;
     ipaddr = strdup(a_ip);
     selector = 0;
+    TrackInterest();  // we only ever want to read
     mainfd = -1;
+    backlog = SUE_TCP_BACKLOG;
+    sparefd = -1;
+    reuseport = false;
     sessions = 0;
+    sessionscount = 0;
+    visits = 0;
+    pthread_mutex_init(&sessionslock, 0);
+    reactors = 0;
+    reactorscount = 0;
+    nextreactor = 0;
     acceptedsockaddr = new sockaddr_in;
 }
 
@@ -42,9 +69,8 @@ SUETcpServer::~SUETcpServer()
 {
     if(ipaddr) free(ipaddr);
     while(sessions) {
-        SessionsListItem *tmp = sessions;
-        sessions = tmp->next;
-        delete tmp->sess;
+        SUETcpServerSession *tmp = sessions;
+        sessions = tmp->nextsess;
         delete tmp;
     }
     delete acceptedsockaddr;
@@ -52,27 +78,47 @@ SUETcpServer::~SUETcpServer()
         shutdown(mainfd, 2);
         close(mainfd);
     }
+    if(sparefd != -1)
+        close(sparefd);
+    if(reactors) delete[] reactors;
+    pthread_mutex_destroy(&sessionslock);
 }
 
 bool SUETcpServer::Up(SUEEventSelector *a_selector)
 {
     selector = a_selector;
     struct sockaddr_in SockAddrIn;
-    mainfd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    mainfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 
+                    IPPROTO_IP);
+    if(mainfd == -1)
+        return false;
     int sockopt = 1;
     setsockopt(mainfd, SOL_SOCKET, SO_REUSEADDR, (char*)&sockopt, 
                                                  sizeof(sockopt));
+    if(reuseport && 0 != setsockopt(mainfd, SOL_SOCKET, SO_REUSEPORT, 
+                                    (char*)&sockopt, sizeof(sockopt)))
+    {
+        close(mainfd);
+        mainfd = -1;
+        return false;
+    }
     SockAddrIn.sin_family = AF_INET;
     SockAddrIn.sin_port = htons(port);
     SockAddrIn.sin_addr.s_addr = inet_addr(ipaddr);
     if (0!=bind(mainfd, (struct sockaddr*)&SockAddrIn, sizeof(SockAddrIn))) {
         /* Error binding the socket */
+        close(mainfd);
+        mainfd = -1;
         return false;
     }
-    if (0 != listen(mainfd, 5)) {
+    if (0 != listen(mainfd, backlog)) {
         /* Error listening port */
+        close(mainfd);
+        mainfd = -1;
         return false;
     }
+    if(sparefd == -1)
+        sparefd = open_spare_fd();
     SetFd(mainfd);
     selector->RegisterFdHandler(this);
     return true;
@@ -82,20 +128,100 @@ void SUETcpServer::Down()
 {
     selector->RemoveFdHandler(this); 
     close(mainfd);
-    while(sessions) sessions->sess->Shutdown();
+    mainfd = -1;
+    while(sessions) sessions->Shutdown();
 }
 
+void SUETcpServer::AddReactor(SUEReactorThread *a_reactor)
+{
+    SUEReactorThread **tmp = new SUEReactorThread*[reactorscount+1];
+    for(int i = 0; i < reactorscount; i++)
+        tmp[i] = reactors[i];
+    tmp[reactorscount] = a_reactor;
+    if(reactors) delete[] reactors;
+    reactors = tmp;
+    reactorscount++;
+}
+
+class SUETcpServer::SpawnMessage : public SUEMessage {
+    SUETcpServer *server;
+    SUEEventSelector *selector;
+    int fd;
+public:
+    SpawnMessage(SUETcpServer *s, SUEEventSelector *sel, int a_fd)
+        : server(s), selector(sel), fd(a_fd) {}
+    ~SpawnMessage() { if(fd != -1) close(fd); }
+    virtual void Deliver() {
+        int conn = fd;
+        fd = -1;  // the session owns it from now on
+        server->AddSession(server->SpawnReactorSession(conn, selector));
+    }
+};
+
 void SUETcpServer::FdHandle(bool a_r, bool /*a_w*/, bool /*a_ex*/)
 {
     if(!a_r) return;  /* this must be a bug, but... let it be ;-) */
-    socklen_t SockAddrLen;
-    SockAddrLen = sizeof(sockaddr_in);
-    int conn = accept(mainfd, (sockaddr*)acceptedsockaddr, &SockAddrLen);
-    fcntl(conn, F_SETFL, O_NONBLOCK);
-    SessionsListItem *tmp = new SessionsListItem;
-    tmp->sess = SpawnSession(conn);
-    tmp->next = sessions;
-    sessions = tmp;
+    if(sparefd == -1)
+        sparefd = open_spare_fd();  // failed last time
+    for(int i = 0; i < SUE_ACCEPT_BUDGET; i++) {
+        socklen_t SockAddrLen;
+        SockAddrLen = sizeof(sockaddr_in);
+        int conn = accept4(mainfd, (sockaddr*)acceptedsockaddr, 
+                           &SockAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(conn == -1) {
+            switch(errno) {
+            case EINTR:
+            case ECONNABORTED:
+            case EPROTO:
+                continue;   // the next one may be fine
+            case EMFILE:
+            case ENFILE:
+                if(sparefd == -1)
+                    return;
+                ShedConnection();
+                continue;
+            default:
+                return;     // EAGAIN or something we can't help
+            }
+        }
+        if(reactorscount > 0) {
+            SUEReactorThread *r = reactors[nextreactor];
+            nextreactor = (nextreactor + 1) % reactorscount;
+            r->Post(new SpawnMessage(this, r->GetSelector(), conn));
+            continue;
+        }
+        AddSession(SpawnSession(conn));
+    }
+}
+
+  // we're out of descriptors: free the spare one to accept the 
+  // connection and close it, so that the client isn't left waiting
+void SUETcpServer::ShedConnection()
+{
+    close(sparefd);
+    int conn = accept(mainfd, 0, 0);
+    if(conn != -1)
+        close(conn);
+    sparefd = open_spare_fd();
+}
+
+SUETcpServerSession* SUETcpServer::SpawnReactorSession(int newsessionfd,
+                                                 SUEEventSelector *)
+{
+    close(newsessionfd);
+    throw SUEException("the server doesn't support reactor threads");
+}
+
+void SUETcpServer::AddSession(SUETcpServerSession *sess)
+{
+    pthread_mutex_lock(&sessionslock);
+    sess->prevsess = 0;
+    sess->nextsess = sessions;
+    if(sessions)
+        sessions->prevsess = sess;
+    sessions = sess;
+    sessionscount++;
+    pthread_mutex_unlock(&sessionslock);
 }
 
 unsigned long SUETcpServer::GetIpOfLastAccepted() const
@@ -105,19 +231,39 @@ unsigned long SUETcpServer::GetIpOfLastAccepted() const
 
 void SUETcpServer::NotifySessionDown(SUETcpServerSession *sess)
 {
-    SessionsListItem **tmp = &sessions;  
-    while(*tmp && (*tmp)->sess != sess) {
-       tmp = &((*tmp)->next);
-    }
-    if(*tmp) {
-        SessionsListItem *tmp2 = *tmp;
-        *tmp = (*tmp)->next; 
-        delete tmp2->sess;
-        delete tmp2;
-    } else {
+    pthread_mutex_lock(&sessionslock);
+    if(sess->server != this || (!sess->prevsess && sessions != sess)) {
+        pthread_mutex_unlock(&sessionslock);
         // Removing non-own session - BUG
         throw SUEException("Cant remove foreign TCP session");
     }
+    for(VisitPosition *p = visits; p; p = p->outer)
+        if(p->next == sess)
+            p->next = sess->nextsess;
+    if(sess->prevsess)
+        sess->prevsess->nextsess = sess->nextsess;
+    else
+        sessions = sess->nextsess;
+    if(sess->nextsess)
+        sess->nextsess->prevsess = sess->prevsess;
+    sessionscount--;
+    pthread_mutex_unlock(&sessionslock);
+    delete sess;
+}
+
+void SUETcpServer::ForEachSession(SUETcpSessionVisitor *a_visitor)
+{
+      // the visitor may iterate, too, so the positions form a stack
+    VisitPosition pos;
+    pos.outer = visits;
+    visits = &pos;
+    SUETcpServerSession *sess = sessions;
+    while(sess) {
+        pos.next = sess->nextsess;
+        a_visitor->Visit(sess);
+        sess = pos.next;
+    }
+    visits = pos.outer;
 }
 
 
@@ -129,6 +275,8 @@ SUETcpServerSession::SUETcpServerSession(int a_fd, int a_timeout,
    : SUEInetDuplexSession(a_timeout, a_greeting)
 {
     server = a_server;
+    prevsess = 0;
+    nextsess = 0;
     Startup(a_selector, a_fd);
 }
 
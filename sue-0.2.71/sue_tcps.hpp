@@ -19,12 +19,26 @@
 #ifndef SENTRY_SUE_TCPS_HPP
 #define SENTRY_SUE_TCPS_HPP
 
+#include <pthread.h>
+
 #include "sue_sel.hpp"
 #include "sue_inet.hpp"
 
 struct sockaddr_in;
 
 class SUETcpServerSession;
+class SUEReactorThread;
+
+//! Something to do with every session of a SUETcpServer
+/*! Subclass it overriding Visit(), then pass the object to 
+  SUETcpServer::ForEachSession().
+*/
+class SUETcpSessionVisitor {
+public:
+    virtual ~SUETcpSessionVisitor() {}
+    //! Called for every session
+    virtual void Visit(SUETcpServerSession *sess) = 0;
+};
 
 //! Generic TCP protocol server
 /*! This class implements a generic multiuser TCP server.
@@ -43,6 +57,11 @@ class SUETcpServerSession;
     reference to YOUR Selector
   - check if everyting's Ok (the Up() returned true)
   - run the main loop (see the SUEFdSelector class description)
+  \par
+  To spread the sessions among several threads, create a number of
+  SUEReactorThread objects, pass them to AddReactor() before you
+  call Up(), and override SpawnReactorSession() in addition to
+  SpawnSession().
 */ 
 class SUETcpServer : private SUEFdHandler {
     //! TCP port to listen 
@@ -51,11 +70,40 @@ class SUETcpServer : private SUEFdHandler {
     char *ipaddr;
     //! Descriptor of the listening socket
     int mainfd;
+    //! Length of the queue of connections to accept, see SetBacklog()
+    int backlog;
+    //! Descriptor kept open to be freed when we run out of them
+    int sparefd;
+    //! Whether to let other sockets listen the same port
+    bool reuseport;
     //! Our sessions
-    struct SessionsListItem {
-        SUETcpServerSession *sess;
-        SessionsListItem *next;
-    } *sessions;
+    /*! The list is threaded through the session objects themselves
+      (see SUETcpServerSession::prevsess and nextsess), so a session
+      gets in and out of it in constant time.
+    */
+    SUETcpServerSession *sessions;
+    //! How many sessions there are in the list
+    int sessionscount;
+    //! Where the ForEachSession() calls in progress are
+    /*! When a session leaves the list, the positions pointing to it
+      are moved past it, so the iteration survives sessions shut down
+      by the visitor.  The innermost call comes first.
+    */
+    struct VisitPosition {
+        SUETcpServerSession *next;
+        VisitPosition *outer;
+    } *visits;
+    //! Guards the sessions list when reactor threads are used
+    pthread_mutex_t sessionslock;
+
+    //! Reactor threads to hand accepted sessions over to
+    SUEReactorThread **reactors;
+    int reactorscount;
+    //! Index of the reactor to get the next session
+    int nextreactor;
+
+    class SpawnMessage;
+    friend class SpawnMessage;
 
     struct sockaddr_in *acceptedsockaddr;
     
@@ -64,6 +112,13 @@ protected: // For overriden SpawnSession
     SUEEventSelector *selector;
 private:
     //! Handler of the listening socket descriptor's events
+    /*! Accepts up to SUE_ACCEPT_BUDGET connections at a time, so that
+      a crowd connecting at once is served without a loop iteration 
+      per connection, yet the sessions already served don't wait for
+      the whole crowd.  If we run out of descriptors, the connections
+      waiting are accepted and closed right away, using the spare 
+      descriptor, so that the clients don't wait in vain.
+    */
     virtual void FdHandle(bool a_r, bool a_w, bool a_ex);
 public:
     //! Constructor
@@ -90,13 +145,42 @@ public:
       wrong.
     */
     bool Up(SUEEventSelector *a_selector);
+    //! Set the length of the queue of connections to accept
+    /*! This is the value to pass to listen(2); the default is 
+      SUE_TCP_BACKLOG, which is SOMAXCONN unless defined otherwise.
+      The kernel may use a smaller value.
+      \note Call it before Up().
+    */
+    void SetBacklog(int a_backlog) { backlog = a_backlog; }
+    //! Let several servers listen the same port
+    /*! With this set, the listening socket gets the SO_REUSEPORT 
+      option, so servers of other processes (with the option set as 
+      well) may listen the same address and port; the kernel spreads 
+      incoming connections among them.
+      \note Call it before Up().
+    */
+    void SetReusePort(bool a_reuseport) { reuseport = a_reuseport; }
     //! Shut the server down
     /*! This method removes the object from Selector, closes the 
       listening socket and shuts down all active tcp sessions 
       created by the server. 
+      \note If reactor threads are used, they must be stopped 
+      (see SUEReactorThread::Stop()) before the server is brought 
+      down or destroyed.
     */
     void Down();
 
+    //! Serve sessions by a reactor thread
+    /*! Once at least one reactor is added, the server doesn't serve
+      the accepted sessions within its own Selector.  Instead, each
+      accepted descriptor is handed over to the next reactor in the 
+      round-robin order, and the session object is created by 
+      SpawnReactorSession() called within that reactor's thread.  The
+      session remains in that thread for all its life.
+      \note The server object doesn't own the reactors.
+    */
+    void AddReactor(SUEReactorThread *a_reactor);
+
     //! Get the ip address of the last accepted session 
     /*! returns the ip address in the HOST byte order */
     unsigned long GetIpOfLastAccepted() const;
@@ -111,6 +195,19 @@ public:
     */
     void NotifySessionDown(SUETcpServerSession* sess);
 
+    //! Visit all the sessions
+    /*! Calls the visitor's Visit() for every session of the server.
+      The visitor may shut down any sessions, including the one it is
+      given, as well as those not visited yet (they won't be visited
+      then).  Sessions created during the iteration may or may not be
+      visited.
+      \note With reactor threads used, the sessions belong to the
+      threads, and visiting them from elsewhere is not safe.
+    */
+    void ForEachSession(SUETcpSessionVisitor *a_visitor);
+    //! How many sessions there are now
+    int GetSessionCount() const { return sessionscount; }
+
 
 protected:
     //! Method to create a custom SUETcpServerSession object.
@@ -129,6 +226,20 @@ protected:
       SUETcpServer class.
     */  
     virtual SUETcpServerSession* SpawnSession(int newsessionfd) = 0;
+
+    //! Create a session to be served by a reactor thread
+    /*! This method is the same as SpawnSession() except that it is
+      called by the reactor thread (see AddReactor()), and the session
+      must be registered with the given Selector, not the server's one.
+      Please note that several reactors may call the method at the
+      same time.  The default implementation throws an exception.
+    */
+    virtual SUETcpServerSession* SpawnReactorSession(int newsessionfd, 
+                                            SUEEventSelector *a_selector);
+
+private:
+    void AddSession(SUETcpServerSession *sess);
+    void ShedConnection();
 };
 
 //! Generic Tcp Session to be used with SUETcpServer
@@ -150,6 +261,8 @@ class SUETcpServerSession : public SUEInetDuplexSession {
     friend class SUETcpServer;
     //! The TCP server we belong to
     SUETcpServer *server;
+    //! Neighbours in the server's list of sessions
+    SUETcpServerSession *prevsess, *nextsess;
     
 protected: 
     //! Constructor
@@ -0,0 +1,265 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if defined(__linux__) && !defined(SUE_NO_EVENTFD)
+#define SUE_HAVE_EVENTFD 1
+#include <sys/eventfd.h>
+#endif
+
+#include "sue_thr.hpp"
+
+
+SUEMailbox::SUEMailbox()
+{
+    head = 0;
+    pending = 0;
+    the_selector = 0;
+    TrackInterest();  // we only ever want to read
+    wakefd = -1;
+    int readfd = -1;
+#ifdef SUE_HAVE_EVENTFD
+    readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wakefd = readfd;
+#endif
+    if(readfd == -1) {
+        int fds[2];
+        if(-1 == pipe(fds))
+            throw SUEException("can't create pipe for a mailbox");
+        for(int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        readfd = fds[0];
+        wakefd = fds[1];
+    }
+    SetFd(readfd);
+}
+
+void SUEMailbox::DeleteList(SUEMessage *list)
+{
+    while(list) {
+        SUEMessage *tmp = list;
+        list = list->next;
+        delete tmp;
+    }
+}
+
+SUEMailbox::~SUEMailbox()
+{
+    Unregister();
+    DeleteList(pending);
+    DeleteList(head);
+    if(wakefd != fd)
+        close(wakefd);
+    close(fd);
+}
+
+void SUEMailbox::Register(SUEEventSelector *a_selector)
+{
+    Unregister();
+    the_selector = a_selector;
+    the_selector->RegisterFdHandler(this);
+}
+
+void SUEMailbox::Unregister()
+{
+    if(the_selector) {
+        the_selector->RemoveFdHandler(this);
+        the_selector = 0;
+    }
+}
+
+void SUEMailbox::Post(SUEMessage *msg)
+{
+    SUEMessage *old = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    do {
+        msg->next = old;
+    } while(!__atomic_compare_exchange_n(&head, &old, msg, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    // only the one who made the stack non-empty has to wake the owner;
+    // the owner drains the descriptor before it takes the stack, so
+    // no wakeup can get lost
+    if(!old)
+        Wake();
+}
+
+void SUEMailbox::Wake()
+{
+#ifdef SUE_HAVE_EVENTFD
+    if(wakefd == fd) {
+        eventfd_write(wakefd, 1);
+        return;
+    }
+#endif
+    char c = 0;
+    // if the pipe is full, the owner is going to wake up anyway
+    int rc = write(wakefd, &c, 1);
+    (void)rc;
+}
+
+void SUEMailbox::Drain()
+{
+#ifdef SUE_HAVE_EVENTFD
+    if(wakefd == fd) {
+        eventfd_t value;
+        eventfd_read(fd, &value);
+        return;
+    }
+#endif
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0)
+        {}
+}
+
+int SUEMailbox::Dispatch()
+{
+    SUEMessage *taken = __atomic_exchange_n(&head, (SUEMessage*)0, 
+                                            __ATOMIC_ACQUIRE);
+    // the stack has the latest message on the top, so reverse it
+    SUEMessage *fifo = 0;
+    while(taken) {
+        SUEMessage *tmp = taken;
+        taken = tmp->next;
+        tmp->next = fifo;
+        fifo = tmp;
+    }
+    // normally nothing is pending here, unless a message threw last time
+    SUEMessage **tail = &pending;
+    while(*tail)
+        tail = &((*tail)->next);
+    *tail = fifo;
+
+    int count = 0;
+    while(pending) {
+        SUEMessage *msg = pending;
+        pending = msg->next;
+        try {
+            msg->Deliver();
+        }
+        catch(...) {
+            delete msg;
+            // make sure we come back for the rest
+            if(pending)
+                Wake();
+            throw;
+        }
+        delete msg;
+        count++;
+    }
+    return count;
+}
+
+void SUEMailbox::FdHandle(bool a_r, bool, bool)
+{
+    if(!a_r)
+        return;
+    Drain();
+    Dispatch();
+}
+
+
+
+class SUEReactorThread::StopMessage : public SUEMessage {
+    SUEReactorThread *the_thread;
+public:
+    StopMessage(SUEReactorThread *t) : the_thread(t) {}
+    virtual void Deliver() {
+        the_thread->stopping = true;
+        the_thread->selector.Break();
+    }
+};
+
+SUEReactorThread::SUEReactorThread(SUEEventSelector::Backend a_backend)
+    : selector(a_backend)
+{
+    running = false;
+    stopping = false;
+    mailbox.Register(&selector);
+}
+
+SUEReactorThread::~SUEReactorThread()
+{
+    Stop();
+    mailbox.Unregister();
+}
+
+bool SUEReactorThread::Start()
+{
+    if(running)
+        return true;
+    stopping = false;
+    // the new thread inherits the signal mask, so block everything
+    // for the time we create it
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int rc = pthread_create(&thread, 0, ThreadMain, this);
+    pthread_sigmask(SIG_SETMASK, &saved, 0);
+    if(rc != 0)
+        return false;
+    running = true;
+    return true;
+}
+
+void SUEReactorThread::Stop()
+{
+    if(!running)
+        return;
+    mailbox.Post(new StopMessage(this));
+    pthread_join(thread, 0);
+    running = false;
+}
+
+bool SUEReactorThread::IsCurrent() const
+{
+    return running && pthread_equal(pthread_self(), thread);
+}
+
+void SUEReactorThread::HandleException(const char *msg)
+{
+    fprintf(stderr, "SUEReactorThread: exception: %s\n", msg);
+}
+
+void *SUEReactorThread::ThreadMain(void *arg)
+{
+    static_cast<SUEReactorThread*>(arg)->Run();
+    return 0;
+}
+
+void SUEReactorThread::Run()
+{
+    while(!stopping) {
+        try {
+            selector.Go();
+        }
+        catch(SUEException &ex) {
+            HandleException(ex.Get());
+        }
+        catch(const char *msg) {
+            HandleException(msg);
+        }
+        catch(...) {
+            HandleException("unknown exception");
+        }
+    }
+}
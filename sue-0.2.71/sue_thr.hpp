@@ -0,0 +1,166 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#ifndef SENTRY_SUE_THR_HPP
+#define SENTRY_SUE_THR_HPP
+
+#include <pthread.h>
+
+#include "sue_sel.hpp"
+
+
+class SUEMailbox;
+
+//! Message passed to another thread
+/*! A message is a piece of work one thread asks another thread to do.
+    Create a subclass overriding the Deliver() method, allocate the
+    object with the new operator and Post() it to the mailbox of the 
+    thread which is to perform the work.  Deliver() is called by the 
+    thread owning the mailbox, and the object is deleted right after 
+    that, so everything the message needs should be stored within it.
+    \note The message must not reference objects owned by the sending
+    thread unless their lifetime is guaranteed otherwise.
+ */
+class SUEMessage {
+    friend class SUEMailbox;
+    SUEMessage *next;
+public:
+    SUEMessage() : next(0) {}
+    virtual ~SUEMessage() {}
+        //! Do the work
+        /*! Called by the thread owning the mailbox the message was
+            posted to.
+         */
+    virtual void Deliver() = 0;
+};
+
+//! Mailbox of a selector thread
+/*! The mailbox lets any thread hand messages (see SUEMessage) over to 
+    the thread running the selector the mailbox is registered with.
+    Posting is lock-free: the message is pushed onto an atomic stack,
+    and the first message pushed onto the empty stack wakes the owning
+    selector up through an eventfd(2) descriptor (a pipe where eventfd 
+    is not available).  The owning thread takes the whole stack at once
+    and delivers the messages in the order they were posted (the order 
+    is only guaranteed for messages posted by the same thread, of
+    course).
+ */
+class SUEMailbox : private SUEFdHandler {
+        //! Messages posted but not taken yet, the latest on the top
+    SUEMessage *head;
+        //! Messages taken but not delivered yet (after an exception)
+    SUEMessage *pending;
+        //! Descriptor to write to in order to wake the owner up
+    int wakefd;
+    SUEEventSelector *the_selector;
+public:
+    SUEMailbox();
+        //! Destructor
+        /*! Undelivered messages are deleted without delivery */
+    ~SUEMailbox();
+
+        //! Attach the mailbox to the selector of the owning thread
+        /*! Must be called by the owning thread, or before the thread
+            is started.
+         */
+    void Register(SUEEventSelector *a_selector);
+        //! Detach the mailbox from its selector
+    void Unregister();
+
+        //! Post the message
+        /*! May be called from any thread, including the owning one.
+            The mailbox takes the ownership of the message.
+         */
+    void Post(SUEMessage *msg);
+
+        //! Deliver all the messages posted so far
+        /*! Normally the selector calls this when the mailbox descriptor
+            becomes readable; it is only to be called by the owning 
+            thread.  Returns the count of delivered messages.
+         */
+    int Dispatch();
+
+private:
+    virtual void FdHandle(bool a_r, bool a_w, bool a_ex);
+    void Wake();
+    void Drain();
+    static void DeleteList(SUEMessage *list);
+};
+
+//! Selector running in a thread of its own
+/*! The object combines an SUEEventSelector, a thread which runs its 
+    main loop and a mailbox (SUEMailbox) through which other threads
+    ask the thread to do something.  Objects (descriptor handlers,
+    sessions, timeouts) registered with the selector of a reactor 
+    thread must only be touched by that thread; other threads are to
+    Post() messages instead.
+    \par
+    The thread is created with all signals blocked, so that signals
+    are only handled by the thread which registered the signal handlers.
+ */
+class SUEReactorThread {
+    SUEEventSelector selector;
+    SUEMailbox mailbox;
+    pthread_t thread;
+    bool running;
+    bool stopping;
+
+    class StopMessage;
+    friend class StopMessage;
+public:
+        //! Constructor
+        /*! The thread is not started here, see Start() */
+    SUEReactorThread(SUEEventSelector::Backend a_backend = 
+                                 SUEEventSelector::backend_default);
+        //! Destructor
+        /*! Stops the thread if it is still running */
+    virtual ~SUEReactorThread();
+
+        //! The selector of the thread
+    SUEEventSelector *GetSelector() { return &selector; }
+        //! Post a message to the thread (see SUEMailbox::Post())
+    void Post(SUEMessage *msg) { mailbox.Post(msg); }
+
+        //! Start the thread
+        /*! Returns false if the thread couldn't be created */
+    bool Start();
+        //! Stop the thread
+        /*! Asks the thread to break its main loop and waits for it to
+            finish.  Messages already posted are delivered before the 
+            thread exits.  Handlers registered with the selector are 
+            left intact, so the calling thread may safely dispose of 
+            them afterwards.
+         */
+    void Stop();
+
+        //! Is the calling thread the one of this object?
+    bool IsCurrent() const;
+
+protected:
+        //! Exception notification
+        /*! Called within the thread when an exception escapes the 
+            main loop; the loop is restarted afterwards.  The default
+            implementation prints the message to stderr.
+         */
+    virtual void HandleException(const char *msg);
+
+private:
+    static void *ThreadMain(void *arg);
+    void Run();
+};
+
+#endif
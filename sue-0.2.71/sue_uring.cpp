@@ -0,0 +1,605 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#if defined(__linux__) && !defined(SUE_NO_URING)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+  // multishot recv appeared in Linux 6.0, together with this flag
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define SUE_HAVE_URING 1
+#endif
+#endif
+
+#include "sue_sess.hpp"
+#include "sue_uring.hpp"
+
+
+#ifndef SUE_URING_ENTRIES
+#define SUE_URING_ENTRIES 256
+#endif
+
+  // the count must be a power of 2
+#ifndef SUE_URING_BUFFERS
+#define SUE_URING_BUFFERS 256
+#endif
+
+#ifndef SUE_URING_BUFFER_SIZE
+#define SUE_URING_BUFFER_SIZE 4096
+#endif
+
+
+struct SUEUring::Slot {
+    SUEGenericDuplexSession *owner;  // 0 once the session is detached
+    int fd;
+    int inflight;        // operations to get completions for
+    bool receiving;      // the multishot recv is armed
+    bool sending;        // the content of sendbuf is being sent
+    bool pending;        // in the list of slots to be flushed
+      // the operations which didn't fit into the submission queue,
+      // to be retried on the next Flush()
+    bool recvwait, sendwait, cancelwait;
+    char *sendbuf;
+    int sendlen, sendpos, sendsize;
+    Slot *prev, *next;
+    Slot *pendprev, *pendnext;
+};
+
+  // the low bits of user_data tell what the operation was
+enum { op_recv = 0, op_send = 1, op_cancel = 2, op_mask = 3 };
+
+
+#ifdef SUE_HAVE_URING
+
+struct SUEUring::Ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+      // the ring tail overlays the resv field of the first entry; 
+      // struct io_uring_buf_ring is not used as the flexible array 
+      // member is misplaced when the header is compiled as C++
+    struct io_uring_buf *bufring;
+    size_t bufring_len;
+    unsigned short buf_tail;
+    char *buffers;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, 
+                              unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, 
+                   flags, (void*)0, (size_t)0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, 
+                                 void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *ring_ptr(void *base, unsigned offset)
+{
+    return (char*)base + offset;
+}
+
+static void *map_ring(size_t len, int fd, off_t offset)
+{
+    void *p = mmap(0, len, PROT_READ|PROT_WRITE, 
+                   MAP_SHARED|MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+#else
+
+struct SUEUring::Ring {};
+
+#endif
+
+
+SUEUring::SUEUring()
+{
+    ring = 0;
+    first = 0;
+    firstpending = 0;
+    the_selector = 0;
+    sqfull = false;
+    TrackInterest();  // we only ever want to read
+}
+
+SUEUring::~SUEUring()
+{
+    if(the_selector)
+        the_selector->RemoveFdHandler(this);
+    while(first) {
+        Slot *tmp = first;
+        first = tmp->next;
+        if(tmp->sendbuf)
+            delete[] tmp->sendbuf;
+        delete tmp;
+    }
+    if(ring)
+        ReleaseRing(ring);
+}
+
+bool SUEUring::Setup(SUEEventSelector *a_selector)
+{
+#ifdef SUE_HAVE_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = SUE_URING_ENTRIES * 4;
+    int fd = sys_io_uring_setup(SUE_URING_ENTRIES, &p);
+    if(fd == -1)
+        return false;
+    Ring *r = new Ring;
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    if(!(p.features & IORING_FEAT_NODROP)) {
+        ReleaseRing(r);
+        return false;
+    }
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = 
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && r->cq_map_len > r->sq_map_len)
+        r->sq_map_len = r->cq_map_len;
+    r->sq_map = map_ring(r->sq_map_len, fd, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map : 
+                         map_ring(r->cq_map_len, fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)map_ring(r->sqes_len, fd, IORING_OFF_SQES);
+    r->bufring_len = SUE_URING_BUFFERS * sizeof(struct io_uring_buf);
+    void *br = mmap(0, r->bufring_len, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    r->bufring = br == MAP_FAILED ? 0 : (struct io_uring_buf*)br;
+    if(!r->sq_map || !r->cq_map || !r->sqes || !r->bufring) {
+        ReleaseRing(r);
+        return false;
+    }
+    r->sq_head = (unsigned*)ring_ptr(r->sq_map, p.sq_off.head);
+    r->sq_tail = (unsigned*)ring_ptr(r->sq_map, p.sq_off.tail);
+    r->sq_mask = (unsigned*)ring_ptr(r->sq_map, p.sq_off.ring_mask);
+    r->sq_flags = (unsigned*)ring_ptr(r->sq_map, p.sq_off.flags);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    unsigned *sq_array = (unsigned*)ring_ptr(r->sq_map, p.sq_off.array);
+    for(unsigned i = 0; i < p.sq_entries; i++)
+        sq_array[i] = i;
+    r->cq_head = (unsigned*)ring_ptr(r->cq_map, p.cq_off.head);
+    r->cq_tail = (unsigned*)ring_ptr(r->cq_map, p.cq_off.tail);
+    r->cq_mask = (unsigned*)ring_ptr(r->cq_map, p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)ring_ptr(r->cq_map, p.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->bufring;
+    reg.ring_entries = SUE_URING_BUFFERS;
+    reg.bgid = 0;
+    if(0 != sys_io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+          // the kernel is too old for provided buffer rings
+        ReleaseRing(r);
+        return false;
+    }
+    r->buffers = new char[SUE_URING_BUFFERS * SUE_URING_BUFFER_SIZE];
+    ring = r;
+    for(int i = 0; i < SUE_URING_BUFFERS; i++)
+        RecycleBuffer(i);
+
+    the_selector = a_selector;
+    SetFd(fd);
+    the_selector->RegisterFdHandler(this);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SUEUring::ReleaseRing(Ring *r)
+{
+#ifdef SUE_HAVE_URING
+      // works for partially set up rings, too
+    if(r->bufring)
+        munmap(r->bufring, r->bufring_len);
+    if(r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if(r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    if(r->sq_map)
+        munmap(r->sq_map, r->sq_map_len);
+    if(r->buffers)
+        delete[] r->buffers;
+    close(r->fd);
+#endif
+    delete r;
+}
+
+SUEUring::Slot *SUEUring::Attach(SUEGenericDuplexSession *sess, int fd)
+{
+    Slot *slot = new Slot;
+    slot->owner = sess;
+    slot->fd = fd;
+    slot->inflight = 0;
+    slot->receiving = false;
+    slot->sending = false;
+    slot->pending = false;
+    slot->recvwait = slot->sendwait = slot->cancelwait = false;
+    slot->sendbuf = 0;
+    slot->sendlen = slot->sendpos = slot->sendsize = 0;
+    slot->prev = 0;
+    slot->next = first;
+    if(first)
+        first->prev = slot;
+    first = slot;
+    ArmRecv(slot);
+    return slot;
+}
+
+void SUEUring::Detach(Slot *slot)
+{
+    slot->owner = 0;
+    DropPending(slot);
+    slot->recvwait = false;
+    if(slot->sendwait) {
+          // the descriptor is closed after we return, so the send 
+          // never queued is dropped
+        slot->sendwait = false;
+        slot->sending = false;
+        slot->inflight--;
+    }
+    if(slot->inflight == 0) {
+        SlotDone(slot);
+        return;
+    }
+    if(slot->receiving) {
+          // counted right away, so the slot is kept until the
+          // cancellation completes, even if it has to wait
+        slot->inflight++;
+        IssueCancel(slot);
+    }
+      // the session closes the descriptor right after we return, 
+      // so the cancellation must reach the kernel before that (the
+      // one which has to wait finds the recv by user_data, not by 
+      // the descriptor, so it works later, too)
+    Submit();
+}
+
+bool SUEUring::IsSending(const Slot *slot) const
+{
+    return slot->sending;
+}
+
+void SUEUring::OutputPending(Slot *slot)
+{
+    if(slot->pending)
+        return;
+    slot->pending = true;
+    slot->pendprev = 0;
+    slot->pendnext = firstpending;
+    if(firstpending)
+        firstpending->pendprev = slot;
+    firstpending = slot;
+}
+
+void SUEUring::DropPending(Slot *slot)
+{
+    if(!slot->pending)
+        return;
+    if(slot->pendprev)
+        slot->pendprev->pendnext = slot->pendnext;
+    else
+        firstpending = slot->pendnext;
+    if(slot->pendnext)
+        slot->pendnext->pendprev = slot->pendprev;
+    slot->pending = false;
+}
+
+void SUEUring::Flush()
+{
+      // make room for the operations which had to wait
+    Submit();
+    sqfull = false;
+      // a slot which is still sending is dropped from the list, too;
+      // the completion of the send puts it back if necessary; once 
+      // the queue is full, the rest wait for the next time
+    while(firstpending && !sqfull) {
+        Slot *tmp = firstpending;
+        DropPending(tmp);
+        if(tmp->cancelwait)
+            IssueCancel(tmp);
+        if(!tmp->owner)
+            continue;
+        if(tmp->recvwait)
+            ArmRecv(tmp);
+        if(tmp->sendwait)
+            IssueSend(tmp);
+        else if(!tmp->sending && tmp->owner->OutputLength())
+            StartSend(tmp);
+    }
+    Submit();
+}
+
+void SUEUring::FdHandle(bool, bool, bool)
+{
+    Reap();
+}
+
+void SUEUring::SlotDone(Slot *slot)
+{
+    DropPending(slot);
+    if(slot->prev)
+        slot->prev->next = slot->next;
+    else
+        first = slot->next;
+    if(slot->next)
+        slot->next->prev = slot->prev;
+    if(slot->sendbuf)
+        delete[] slot->sendbuf;
+    delete slot;
+}
+
+#ifdef SUE_HAVE_URING
+
+void SUEUring::Reap()
+{
+    for(;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail) {
+            if(!(*ring->sq_flags & IORING_SQ_CQ_OVERFLOW))
+                return;
+              // make the kernel move the overflown entries to the ring
+            sys_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+        unsigned long long data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+          // release the entry before the handlers run, as they
+          // may throw
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        Complete(data, res, flags);
+    }
+}
+
+void SUEUring::Complete(unsigned long long data, int res, unsigned flags)
+{
+    Slot *slot = (Slot*)(unsigned long)(data & ~(unsigned long long)op_mask);
+    int op = data & op_mask;
+    bool more = flags & IORING_CQE_F_MORE;
+    SUEGenericDuplexSession *owner = slot->owner;
+
+    if(op == op_recv) {
+        if(flags & IORING_CQE_F_BUFFER) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if(owner && res > 0) {
+                owner->inputbuffer.AddData(
+                    ring->buffers + bid * SUE_URING_BUFFER_SIZE, res);
+            }
+            RecycleBuffer(bid);
+        }
+        if(!more) {
+            slot->receiving = false;
+            slot->inflight--;
+              // the kernel stops a multishot recv once it runs out
+              // of buffers; just start it again
+            if(owner && (res > 0 || res == -ENOBUFS))
+                ArmRecv(slot);
+        }
+        if(owner) {
+            if(res > 0)
+                owner->HandleReadResult(res);
+            else if(res == 0)
+                owner->HandleReadResult(0);
+            else if(res != -ENOBUFS && res != -ECANCELED)
+                owner->HandleReadResult(-1);
+            return;  // the slot might have been detached and deleted
+        }
+    } else if(op == op_send) {
+          // the rest isn't sent once the session is gone, as its
+          // descriptor is closed already
+        if(owner && res > 0 && slot->sendpos + res < slot->sendlen) {
+            slot->sendpos += res;
+            IssueSend(slot);
+            return;
+        }
+        slot->sending = false;
+        slot->inflight--;
+        if(owner) {
+            if(owner->OutputLength())
+                OutputPending(slot);
+            owner->HandleWriteResult(res > 0 ? slot->sendlen : -1);
+            return;  // the slot might have been detached and deleted
+        }
+    } else {
+        slot->inflight--;
+    }
+    if(!slot->owner && slot->inflight == 0)
+        SlotDone(slot);
+}
+
+  // returns 0 if the queue is full and the kernel doesn't take the
+  // entries right now; the caller must retry on the next Flush()
+struct io_uring_sqe *SUEUring::GetSqe()
+{
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+        >= ring->sq_entries)
+    {
+        Submit();
+        if(ring->sq_local_tail - 
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+            >= ring->sq_entries)
+        {
+            sqfull = true;
+            return 0;
+        }
+    }
+    struct io_uring_sqe *sqe = 
+        ring->sqes + (ring->sq_local_tail & *ring->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+void SUEUring::Submit()
+{
+    if(!ring->to_submit)
+        return;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while(ring->to_submit) {
+        int rc = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+        if(rc > 0) {
+            ring->to_submit -= rc;
+        } else if(rc == -1 && errno == EINTR) {
+            continue;
+        } else {
+              // EAGAIN or EBUSY: the kernel is short of resources,
+              // let's retry on the next iteration
+            return;
+        }
+    }
+}
+
+void SUEUring::ArmRecv(Slot *slot)
+{
+    struct io_uring_sqe *sqe = GetSqe();
+    if(!sqe) {
+        slot->recvwait = true;
+        OutputPending(slot);
+        return;
+    }
+    slot->recvwait = false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = slot->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (unsigned long)slot | op_recv;
+    slot->receiving = true;
+    slot->inflight++;
+}
+
+void SUEUring::StartSend(Slot *slot)
+{
+    SUEGenericDuplexSession *sess = slot->owner;
+    int len = sess->OutputLength();
+    if(slot->sendsize < len) {
+        if(slot->sendbuf)
+            delete[] slot->sendbuf;
+        slot->sendsize = len;
+        slot->sendbuf = new char[len];
+    }
+      // the send takes a single buffer, so shared payloads are copied, too
+    int copied = 0;
+    while(copied < len) {
+        struct iovec iov[16];
+        int n = sess->GatherOutput(iov, 16);
+        int got = 0;
+        for(int i = 0; i < n; i++) {
+            memcpy(slot->sendbuf + copied + got, iov[i].iov_base, 
+                   iov[i].iov_len);
+            got += iov[i].iov_len;
+        }
+        sess->ConsumeOutput(got);
+        copied += got;
+    }
+    slot->sendlen = len;
+    slot->sendpos = 0;
+    slot->sending = true;
+    slot->inflight++;
+    IssueSend(slot);
+}
+
+  // sends what's left of sendbuf
+void SUEUring::IssueSend(Slot *slot)
+{
+    struct io_uring_sqe *sqe = GetSqe();
+    if(!sqe) {
+        slot->sendwait = true;
+        OutputPending(slot);
+        return;
+    }
+    slot->sendwait = false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = slot->fd;
+    sqe->addr = (unsigned long)(slot->sendbuf + slot->sendpos);
+    sqe->len = slot->sendlen - slot->sendpos;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)slot | op_send;
+}
+
+void SUEUring::IssueCancel(Slot *slot)
+{
+    struct io_uring_sqe *sqe = GetSqe();
+    if(!sqe) {
+        slot->cancelwait = true;
+        OutputPending(slot);
+        return;
+    }
+    slot->cancelwait = false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)slot | op_recv;
+    sqe->user_data = (unsigned long)slot | op_cancel;
+}
+
+void SUEUring::RecycleBuffer(int bid)
+{
+    struct io_uring_buf *b = 
+        ring->bufring + (ring->buf_tail & (SUE_URING_BUFFERS - 1));
+    b->addr = (unsigned long)(ring->buffers + bid * SUE_URING_BUFFER_SIZE);
+    b->len = SUE_URING_BUFFER_SIZE;
+    b->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->bufring[0].resv, ring->buf_tail, 
+                     __ATOMIC_RELEASE);
+}
+
+#else
+
+void SUEUring::Reap() {}
+void SUEUring::Complete(unsigned long long, int, unsigned) {}
+struct io_uring_sqe *SUEUring::GetSqe() { return 0; }
+void SUEUring::Submit() {}
+void SUEUring::ArmRecv(Slot *) {}
+void SUEUring::StartSend(Slot *) {}
+void SUEUring::IssueSend(Slot *) {}
+void SUEUring::IssueCancel(Slot *) {}
+void SUEUring::RecycleBuffer(int) {}
+
+#endif
@@ -0,0 +1,116 @@
+// +-------------------------------------------------------------------------+
+// |              (S)imple (U)nix (E)vents vers. 0.2.71                      |
+// | Copyright (c) Andrey Vikt. Stolyarov <crocodil_AT_croco.net> 2003-2008. |
+// | ----------------------------------------------------------------------- |
+// | This is free software.  Permission is granted to everyone to use, copy  |
+// |        or modify this software under the terms and conditions of        |
+// |                 GNU LESSER GENERAL PUBLIC LICENSE, v. 2.1               |
+// | as published by Free Software Foundation      (see the file LGPL.txt)   |
+// |                                                                         |
+// | Please visit http://www.croco.net/software/sue for a fresh copy of Sue. |
+// | ----------------------------------------------------------------------- |
+// |   This code is provided strictly and exclusively on the "AS IS" basis.  |
+// | !!! THERE IS NO WARRANTY OF ANY KIND, NEITHER EXPRESSED NOR IMPLIED !!! |
+// +-------------------------------------------------------------------------+
+
+
+
+#ifndef SENTRY_SUE_URING_HPP
+#define SENTRY_SUE_URING_HPP
+
+#include "sue_sel.hpp"
+
+class SUEGenericDuplexSession;
+
+//! io_uring(7) based I/O engine for duplex sessions
+/*! The selector creates this object when it is constructed with the
+    SUEEventSelector::backend_uring backend.  Sessions (see
+    SUEGenericDuplexSession) started up with such a selector don't
+    register their descriptors with it; instead, they attach to the 
+    engine, which keeps a multishot recv operation in flight for every
+    session and sends the content of the output buffers.  The data 
+    received is placed into provided buffers the kernel picks itself, 
+    and copied to the session's inputbuffer right away.
+    \par
+    Send operations are queued while the handlers run, and the selector
+    submits all the queued operations with a single system call right
+    before it waits for events again (see Flush()).  Completions are
+    reaped when the descriptor of the ring becomes readable, which is 
+    watched the same way as any other descriptor.  So, a busy session
+    costs about two system calls per loop iteration regardless of the 
+    number of sessions, instead of a read(2) and a write(2) for each.
+    \note You don't need to use the class directly.
+ */
+class SUEUring : private SUEFdHandler {
+public:
+        //! State of an attached session
+        /*! The slot lives until all the operations it started are 
+            completed, even if the session is gone already.
+         */
+    struct Slot;
+private:
+    struct Ring;
+    Ring *ring;
+    Slot *first;
+    Slot *firstpending;
+    SUEEventSelector *the_selector;
+        //! The submission queue ran out of room during this iteration
+    bool sqfull;
+public:
+    SUEUring();
+    ~SUEUring();
+
+        //! Create the ring
+        /*! Returns false if io_uring(7) (or one of the features used,
+            such as multishot recv) is not available.
+         */
+    bool Setup(SUEEventSelector *a_selector);
+
+        //! Start serving the session's descriptor
+    Slot *Attach(SUEGenericDuplexSession *sess, int fd);
+        //! Stop serving the session
+        /*! Operations still in flight are cancelled (except a send, 
+            which is let to finish); the session must not be touched 
+            by the engine after the call.
+         */
+    void Detach(Slot *slot);
+        //! Is there unsent data taken from the session's buffer?
+    bool IsSending(const Slot *slot) const;
+        //! The session's output buffer got data
+        /*! The buffer will be sent on the next Flush().  Calling this
+            once again before that is harmless.
+         */
+    void OutputPending(Slot *slot);
+
+        //! Submit all the queued operations
+        /*! The selector calls this on each iteration right before it
+            waits for events.  Output buffers of the sessions which
+            got data (see OutputPending()) are taken here, too.
+            \note If the submission queue is full and the kernel can't
+            take the entries (EAGAIN or EBUSY), the operations which 
+            don't fit are not lost: they wait for the next call.
+         */
+    void Flush();
+        //! Are there operations waiting for room in the queue?
+        /*! Only meaningful right after Flush(); the selector doesn't
+            sleep long while there are.
+         */
+    bool HasWaiting() const { return firstpending != 0; }
+
+private:
+    virtual void FdHandle(bool a_r, bool a_w, bool a_ex);
+    void Reap();
+    void Complete(unsigned long long data, int res, unsigned flags);
+    struct io_uring_sqe *GetSqe();
+    void Submit();
+    void ArmRecv(Slot *slot);
+    void StartSend(Slot *slot);
+    void IssueSend(Slot *slot);
+    void IssueCancel(Slot *slot);
+    void SlotDone(Slot *slot);
+    void DropPending(Slot *slot);
+    void RecycleBuffer(int bid);
+    static void ReleaseRing(Ring *r);
+};
+
+#endif